@@ -0,0 +1,290 @@
+#include "coder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+// every heap allocation of the process is counted, from any thread, to check that the
+// reusable contexts stop allocating once they are warm
+namespace
+{
+std::atomic<unsigned long long> allocations(0);
+}
+
+void *operator new(const size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *const pointer = std::malloc(size ? size : 1))
+    {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+    std::free(pointer);
+}
+
+namespace
+{
+
+// One synthetic 8-bit page, rows are `width` bytes apart.
+struct Image
+{
+    std::string pattern;
+    uint32_t width;
+    uint32_t height;
+    std::vector<unsigned char> pixels;
+};
+
+uint32_t next_random(uint32_t &seed)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+}
+
+Image make_image(const std::string &pattern, const uint32_t width, const uint32_t height)
+{
+    Image image{ pattern, width, height, std::vector<unsigned char>(static_cast<size_t>(width) * height, 0xff) };
+    uint32_t seed = 12345;
+    for (uint32_t y = 0; y < height; ++y)
+    {
+        unsigned char *const row = image.pixels.data() + static_cast<size_t>(y) * width;
+        if (pattern == "text")
+        {
+            // white margins, lines of short black strokes
+            if (y < height / 10 || y >= height - height / 10 || (y / 12) % 2)
+            {
+                continue;
+            }
+            for (uint32_t x = width / 10; x < width - width / 10; ++x)
+            {
+                if (next_random(seed) % 5 == 0)
+                {
+                    row[x] = 0x00;
+                }
+            }
+        }
+        else if (pattern == "noise")
+        {
+            // halftone: every pixel is a coin flip, the worst case for run coding
+            for (uint32_t x = 0; x < width; ++x)
+            {
+                row[x] = next_random(seed) & 1 ? 0x00 : 0xff;
+            }
+        }
+        else if (pattern == "vstripes")
+        {
+            for (uint32_t x = 0; x < width; ++x)
+            {
+                row[x] = (x / 8) % 2 ? 0x00 : 0xff;
+            }
+        }
+        else if (pattern == "hstripes")
+        {
+            std::memset(row, (y / 8) % 2 ? 0x00 : 0xff, width);
+        }
+    }
+    return image;
+}
+
+// Writes an 8-bit bottom-up bitmap with a grey palette.
+void write_bmp(const std::string &file_name, const Image &image)
+{
+    const uint32_t stride = (image.width + 3) & ~3u;
+    const uint32_t palette_size = 256 * 4;
+    const uint32_t offset = 14 + 40 + palette_size;
+    const uint32_t file_size = offset + stride * image.height;
+
+    std::ofstream out{ file_name, std::ios_base::binary };
+    auto put16 = [&out](const uint16_t value) { out.write((const char*)&value, 2); };
+    auto put32 = [&out](const uint32_t value) { out.write((const char*)&value, 4); };
+    put16(0x4D42); put32(file_size); put16(0); put16(0); put32(offset);
+    put32(40); put32(image.width); put32(image.height); put16(1); put16(8); put32(0);
+    put32(stride * image.height); put32(0); put32(0); put32(256); put32(0);
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        put32(i | (i << 8) | (i << 16));
+    }
+    const char padding[4] = {};
+    for (uint32_t y = 0; y < image.height; ++y)
+    {
+        out.write((const char*)image.pixels.data() + static_cast<size_t>(y) * image.width, image.width);
+        out.write(padding, stride - image.width);
+    }
+}
+
+size_t file_size(const std::string &file_name)
+{
+    std::ifstream in{ file_name, std::ios_base::binary | std::ios_base::ate };
+    return in ? static_cast<size_t>(in.tellg()) : 0;
+}
+
+// Peak resident memory of the process. On Linux the peak is reset before every
+// measurement, elsewhere it is not available and reported as -1.
+void reset_peak_memory()
+{
+#ifdef __linux__
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+#endif
+}
+
+long peak_memory_kb()
+{
+#ifdef __linux__
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+        {
+            return std::atol(line.c_str() + 6);
+        }
+    }
+#endif
+    return -1;
+}
+
+struct Measure
+{
+    double seconds;
+    double allocations;
+    long peak_kb;
+};
+
+// Runs `function` once to warm up, then `iterations` times; time and allocations are per call.
+Measure measure(const int iterations, const std::function<void()> &function)
+{
+    reset_peak_memory();
+    function();
+    const unsigned long long before = allocations.load();
+    const auto start = std::chrono::steady_clock::now();
+    for (int it = 0; it < iterations; ++it)
+    {
+        function();
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return { elapsed.count() / iterations, static_cast<double>(allocations.load() - before) / iterations, peak_memory_kb() };
+}
+
+// Prints one JSON record; the ratio is 8-bit pixel bytes per compressed byte.
+void report(const Image &image, const std::string &variant, const unsigned int threads, const Measure &result,
+            const size_t compressed_size, bool &first)
+{
+    const double pixels = static_cast<double>(image.width) * image.height;
+    std::printf("%s\n  {\"pattern\": \"%s\", \"width\": %u, \"height\": %u, \"variant\": \"%s\", \"threads\": %u, "
+                "\"mb_per_s\": %.2f, \"ns_per_pixel\": %.4f, \"ratio\": %.3f, \"allocations_per_call\": %.1f, "
+                "\"peak_memory_kb\": %ld}",
+                first ? "" : ",", image.pattern.c_str(), image.width, image.height, variant.c_str(), threads,
+                pixels / (1024.0 * 1024.0) / result.seconds, result.seconds * 1e9 / pixels,
+                compressed_size ? pixels / compressed_size : 0.0, result.allocations, result.peak_kb);
+    std::fflush(stdout);
+    first = false;
+}
+
+} // namespace
+
+// coderbench [iterations] [max side]: prints a JSON array with one record per image and variant.
+int main(int argc, char *argv[])
+{
+    const int iterations = argc > 1 ? std::max(1, std::atoi(argv[1])) : 3;
+    const uint32_t max_side = argc > 2 ? std::atoi(argv[2]) : 32768;
+
+    const std::string bmp_file = "coderbench_input.bmp";
+    const std::string barch_file = "coderbench_input.barch";
+    const std::string out_file = "coderbench_output.bmp";
+
+    const char *const patterns[] = { "blank", "text", "noise", "vstripes", "hstripes" };
+    const uint32_t sizes[][2] = { { 1024, 1024 }, { 4096, 4096 }, { 32768, 2048 }, { 2048, 32768 } };
+    const unsigned int max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    bool first = true;
+    std::printf("[");
+    for (const auto &size : sizes)
+    {
+        if (size[0] > max_side || size[1] > max_side)
+        {
+            continue;
+        }
+        for (const char *pattern : patterns)
+        {
+            const Image image = make_image(pattern, size[0], size[1]);
+            const PixelSpan span = { image.pixels.data(), image.width, image.height, image.width, PixelFormat::Gray8 };
+
+            // the classic file to file path; the sizes are read once the measurement has run
+            write_bmp(bmp_file, image);
+            Measure result = measure(iterations, [&]() { compress(bmp_file, barch_file); });
+            report(image, "compress", 1, result, file_size(barch_file), first);
+            result = measure(iterations, [&]() { decompress(barch_file, out_file); });
+            report(image, "decompress", 1, result, file_size(barch_file), first);
+            CoderOptions packed_options;
+            packed_options.output_format = OutputFormat::Bmp1;
+            result = measure(iterations, [&]() { decompress(barch_file, out_file, packed_options); });
+            report(image, "decompress_bmp1", 1, result, file_size(barch_file), first);
+            std::remove(bmp_file.c_str());
+            std::remove(out_file.c_str());
+
+            // in memory, one-shot and through reusable contexts, on one thread and on every core
+            for (unsigned int threads = 1; ; threads = max_threads)
+            {
+                CoderOptions options;
+                options.threads = threads;
+                std::vector<unsigned char> archive;
+                std::vector<unsigned char> pixels;
+                result = measure(iterations, [&]() { compress_buffer(span, archive, options); });
+                report(image, "compress_buffer", threads, result, archive.size(), first);
+                result = measure(iterations, [&]() { decompress_buffer(archive.data(), archive.size(), pixels, options); });
+                report(image, "decompress_buffer", threads, result, archive.size(), first);
+
+                // the same with every row in the v1 bit codes, to weigh the row modes
+                CoderOptions codes_options = options;
+                codes_options.row_modes = false;
+                std::vector<unsigned char> codes_archive;
+                result = measure(iterations, [&]() { compress_buffer(span, codes_archive, codes_options); });
+                report(image, "compress_buffer_codes", threads, result, codes_archive.size(), first);
+                result = measure(iterations, [&]() { decompress_buffer(codes_archive.data(), codes_archive.size(), pixels, codes_options); });
+                report(image, "decompress_buffer_codes", threads, result, codes_archive.size(), first);
+
+                // grey levels taken as white go through the level classifiers
+                CoderOptions level_options = options;
+                level_options.white_level = 0x80;
+                std::vector<unsigned char> level_archive;
+                result = measure(iterations, [&]() { compress_buffer(span, level_archive, level_options); });
+                report(image, "compress_buffer_level", threads, result, level_archive.size(), first);
+
+                Encoder encoder(options);
+                Decoder decoder(options);
+                BarchInfo info;
+                size_t encoded_size = 0;
+                result = measure(iterations, [&]() { encoded_size = encoder.compress(span).size(); });
+                report(image, "encoder", threads, result, encoded_size, first);
+                result = measure(iterations, [&]() { decoder.decompress(archive.data(), archive.size(), info); });
+                report(image, "decoder", threads, result, archive.size(), first);
+                if (threads == max_threads)
+                {
+                    break;
+                }
+            }
+        }
+    }
+    std::printf("\n]\n");
+    std::remove(barch_file.c_str());
+    return 0;
+}
@@ -1,32 +1,51 @@
-#-------------------------------------------------
-#
-# Project created by QtCreator 2023-04-19T16:06:54
-#
-#-------------------------------------------------
-
-QT       -= gui
-
-TARGET = Coder
-TEMPLATE = lib
-CONFIG += staticlib
-
-# The following define makes your compiler emit warnings if you use
-# any feature of Qt which has been marked as deprecated (the exact warnings
-# depend on your compiler). Please consult the documentation of the
-# deprecated API in order to know how to port your code away from it.
-DEFINES += QT_DEPRECATED_WARNINGS
-
-# You can also make your code fail to compile if you use deprecated APIs.
-# In order to do so, uncomment the following line.
-# You can also select to disable deprecated APIs only up to a certain version of Qt.
-#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
-
-SOURCES += \
-        coder.cpp
-
-HEADERS += \
-        coder.h
-unix {
-    target.path = /usr/lib
-    INSTALLS += target
-}
+#-------------------------------------------------
+#
+# Project created by QtCreator 2023-04-19T16:06:54
+#
+#-------------------------------------------------
+
+QT       -= gui
+
+TARGET = Coder
+TEMPLATE = lib
+CONFIG += staticlib c++11
+
+# The following define makes your compiler emit warnings if you use
+# any feature of Qt which has been marked as deprecated (the exact warnings
+# depend on your compiler). Please consult the documentation of the
+# deprecated API in order to know how to port your code away from it.
+DEFINES += QT_DEPRECATED_WARNINGS
+
+# qmake CONFIG+=sanitize builds with AddressSanitizer and UndefinedBehaviorSanitizer, for
+# running untrusted inputs through the coder; everything linked together needs the same setting.
+sanitize {
+    CONFIG += sanitizer sanitize_address sanitize_undefined
+}
+
+# You can also make your code fail to compile if you use deprecated APIs.
+# In order to do so, uncomment the following line.
+# You can also select to disable deprecated APIs only up to a certain version of Qt.
+#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
+
+SOURCES += \
+        archive.cpp \
+        coder.cpp \
+        mappedfile.cpp \
+        resultcache.cpp \
+        rowscan.cpp \
+        stagethread.cpp \
+        workerpool.cpp
+
+HEADERS += \
+        archive.h \
+        coder.h \
+        mappedfile.h \
+        resultcache.h \
+        rowscan.h \
+        spscqueue.h \
+        stagethread.h \
+        workerpool.h
+unix {
+    target.path = /usr/lib
+    INSTALLS += target
+}
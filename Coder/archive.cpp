@@ -0,0 +1,275 @@
+#include "archive.h"
+#include "mappedfile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+
+#pragma pack(push, 1)
+struct ArchiveHeader {
+    char magic[8];                           // "BARCHPAK"
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct ArchiveTrailer {
+    uint64_t index_offset;                   // where the index starts, it ends at the trailer
+    uint32_t entry_count;
+    uint32_t reserved;
+    char magic[8];                           // "BARCHIDX"
+};
+
+// One index record, followed by name_size bytes of the name.
+struct ArchiveRecord {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t width;
+    uint32_t height;
+    uint16_t name_size;
+};
+#pragma pack(pop)
+
+const char archive_magic[8] = { 'B', 'A', 'R', 'C', 'H', 'P', 'A', 'K' };
+const char index_magic[8] = { 'B', 'A', 'R', 'C', 'H', 'I', 'D', 'X' };
+const uint32_t archive_version = 1;
+
+}
+
+ArchiveWriter::ArchiveWriter(const std::string &file_name, const CoderOptions &options)
+    : file_name(file_name)
+    , options(options)
+    , stream(file_name, std::ios_base::binary | std::ios_base::trunc)
+    , cursor(0)
+    , finished(false)
+{
+    if (!stream.is_open())
+    {
+        throw std::runtime_error("Unable to open the output archive file.");
+    }
+    ArchiveHeader header;
+    std::memcpy(header.magic, archive_magic, sizeof(header.magic));
+    header.version = archive_version;
+    header.reserved = 0;
+    stream.write((const char*)&header, sizeof(header));
+    cursor = sizeof(header);
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+    if (!finished)
+    {
+        stream.close();
+        std::remove(file_name.c_str());
+    }
+}
+
+ArchiveEntry ArchiveWriter::add(const std::string &name, const PixelSpan &pixels)
+{
+    std::vector<unsigned char> image;
+    compress_buffer(pixels, image, options);
+    return add_encoded(name, image.data(), image.size());
+}
+
+ArchiveEntry ArchiveWriter::add_file(const std::string &name, const std::string &file_name_in)
+{
+    std::vector<unsigned char> image;
+    compress_to_buffer(file_name_in, image, options);
+    return add_encoded(name, image.data(), image.size());
+}
+
+ArchiveEntry ArchiveWriter::add_encoded(const std::string &name, const unsigned char *data, const size_t size)
+{
+    if (name.empty() || name.size() > 0xffff)
+    {
+        throw std::runtime_error("Error! An archive entry needs a name of 1 to 65535 bytes.");
+    }
+    const BarchInfo info = read_barch_info(data, size);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (finished)
+    {
+        throw std::runtime_error("Error! The archive is already finished.");
+    }
+    if (names.count(name))
+    {
+        throw std::runtime_error("Error! The archive already holds an entry named " + name + ".");
+    }
+    stream.write((const char*)data, size);
+    if (!stream)
+    {
+        throw std::runtime_error("Unable to write the output archive file.");
+    }
+    names[name] = entries.size();
+    entries.push_back({ name, info.width, info.height, cursor, size });
+    cursor += size;
+    return entries.back();
+}
+
+void ArchiveWriter::finish()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (finished)
+    {
+        return;
+    }
+    for (const ArchiveEntry &entry : entries)
+    {
+        const ArchiveRecord record = { entry.offset, entry.size, entry.width, entry.height,
+                                       static_cast<uint16_t>(entry.name.size()) };
+        stream.write((const char*)&record, sizeof(record));
+        stream.write(entry.name.data(), entry.name.size());
+    }
+    ArchiveTrailer trailer;
+    trailer.index_offset = cursor;
+    trailer.entry_count = static_cast<uint32_t>(entries.size());
+    trailer.reserved = 0;
+    std::memcpy(trailer.magic, index_magic, sizeof(trailer.magic));
+    stream.write((const char*)&trailer, sizeof(trailer));
+    stream.close();
+    if (!stream)
+    {
+        throw std::runtime_error("Unable to write the output archive file.");
+    }
+    finished = true;
+}
+
+size_t ArchiveWriter::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+}
+
+ArchiveReader::ArchiveReader(const std::string &file_name, const bool allow_mapping)
+    : file_size(0)
+{
+    if (allow_mapping)
+    {
+        file.reset(new MappedFile(file_name, true, false));
+    }
+    if (file && file->is_mapped())
+    {
+        file_size = file->size();
+    }
+    else
+    {
+        file.reset();
+        stream.open(file_name, std::ios_base::binary | std::ios_base::ate);
+        if (!stream)
+        {
+            throw std::runtime_error("Unable to open the input archive file.");
+        }
+        file_size = static_cast<uint64_t>(stream.tellg());
+    }
+    ArchiveHeader header;
+    ArchiveTrailer trailer;
+    if (file_size < sizeof(header) + sizeof(trailer) || !read_at(0, &header, sizeof(header))
+        || !read_at(file_size - sizeof(trailer), &trailer, sizeof(trailer)))
+    {
+        throw std::runtime_error("Error! Unrecognized archive format.");
+    }
+    if (std::memcmp(header.magic, archive_magic, sizeof(header.magic)) != 0
+        || std::memcmp(trailer.magic, index_magic, sizeof(trailer.magic)) != 0)
+    {
+        throw std::runtime_error("Error! Unrecognized archive format.");
+    }
+    if (header.version != archive_version)
+    {
+        throw std::runtime_error("Error! Unsupported archive version.");
+    }
+
+    // the index lies between the last entry and the trailer, every entry before the index
+    const uint64_t index_end = file_size - sizeof(trailer);
+    if (trailer.index_offset < sizeof(header) || trailer.index_offset > index_end)
+    {
+        throw std::runtime_error("Error! The archive index is damaged.");
+    }
+    std::vector<unsigned char> records(static_cast<size_t>(index_end - trailer.index_offset));
+    if (!read_at(trailer.index_offset, records.data(), records.size()))
+    {
+        throw std::runtime_error("Unable to read the input archive file.");
+    }
+    const unsigned char *const bytes = records.data();
+    const size_t size = records.size();
+    size_t it = 0;
+    index.reserve(std::min<size_t>(trailer.entry_count, size / sizeof(ArchiveRecord)));
+    for (uint32_t entry = 0; entry < trailer.entry_count; ++entry)
+    {
+        ArchiveRecord record;
+        if (size - it < sizeof(record))
+        {
+            throw std::runtime_error("Error! The archive index is damaged.");
+        }
+        std::memcpy(&record, bytes + it, sizeof(record));
+        it += sizeof(record);
+        if (size - it < record.name_size || record.offset < sizeof(header)
+            || record.offset > trailer.index_offset || record.size > trailer.index_offset - record.offset)
+        {
+            throw std::runtime_error("Error! The archive index is damaged.");
+        }
+        std::string name((const char*)bytes + it, record.name_size);
+        it += record.name_size;
+        names.insert(std::make_pair(name, index.size()));
+        index.push_back({ std::move(name), record.width, record.height, record.offset, record.size });
+    }
+}
+
+ArchiveReader::~ArchiveReader() = default;
+
+int ArchiveReader::find(const std::string &name) const
+{
+    const auto found = names.find(name);
+    return found == names.end() ? -1 : static_cast<int>(found->second);
+}
+
+const unsigned char *ArchiveReader::data(const ArchiveEntry &entry) const
+{
+    return file ? file->data() + entry.offset : nullptr;
+}
+
+void ArchiveReader::read(const ArchiveEntry &entry, std::vector<unsigned char> &image) const
+{
+    image.resize(static_cast<size_t>(entry.size));
+    if (!read_at(entry.offset, image.data(), image.size()))
+    {
+        throw std::runtime_error("Unable to read the input archive file.");
+    }
+}
+
+void ArchiveReader::extract(const ArchiveEntry &entry, const std::string &file_name_out, Decoder &decoder) const
+{
+    if (file)
+    {
+        // the entry is read whole, so it is faulted in with one request rather than page by page
+        file->prefetch(static_cast<size_t>(entry.offset), static_cast<size_t>(entry.size));
+        decoder.decompress(data(entry), static_cast<size_t>(entry.size), file_name_out);
+        return;
+    }
+    std::vector<unsigned char> image;
+    read(entry, image);
+    decoder.decompress(image.data(), image.size(), file_name_out);
+}
+
+bool ArchiveReader::read_at(const uint64_t offset, void *out, const size_t size) const
+{
+    if (offset > file_size || file_size - offset < size)
+    {
+        return false;
+    }
+    if (size == 0)
+    {
+        return true;
+    }
+    if (file)
+    {
+        std::memcpy(out, file->data() + offset, size);
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    stream.clear();
+    stream.seekg(static_cast<std::streamoff>(offset), stream.beg);
+    return static_cast<bool>(stream.read((char*)out, size));
+}
@@ -0,0 +1,113 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "coder.h"
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class MappedFile;
+
+// Many images in one file. Each entry is a complete .barch image as compress_buffer() makes
+// it, the entries are stored back to back after a small header, and an index of their names,
+// sizes and places follows the last one:
+//
+//   "BARCHPAK", version, entries..., index, trailer (index offset, entry count, "BARCHIDX")
+//
+// The trailer sits at the very end, so a reader finds any entry with two reads and never
+// walks through the others.
+struct ArchiveEntry
+{
+    std::string name;
+    unsigned int width;
+    unsigned int height;
+    uint64_t offset; // of the .barch image, from the start of the archive
+    uint64_t size;
+};
+
+// Writes an archive. The images are encoded on the threads that add them and only the append
+// is serialized, so adding from several threads at once encodes in parallel. The entries
+// are stored in the order their encoding finishes. Until finish() has written the index the
+// file is incomplete; a writer destroyed before that removes it.
+class ArchiveWriter
+{
+public:
+    explicit ArchiveWriter(const std::string &file_name, const CoderOptions &options = CoderOptions());
+    ~ArchiveWriter();
+
+    ArchiveWriter(const ArchiveWriter&) = delete;
+    void operator=(const ArchiveWriter&) = delete;
+
+    // Encodes and appends an image and returns its entry. Names are unique within an archive,
+    // a name that was already added throws.
+    ArchiveEntry add(const std::string &name, const PixelSpan &pixels);
+
+    // Encodes and appends a BMP file.
+    ArchiveEntry add_file(const std::string &name, const std::string &file_name_in);
+
+    // Appends an image that is already encoded, it is checked to be a .barch image.
+    ArchiveEntry add_encoded(const std::string &name, const unsigned char *data, const size_t size);
+
+    // Writes the index and closes the file, nothing can be added after.
+    void finish();
+
+    size_t size() const;
+
+private:
+    std::string file_name;
+    CoderOptions options;
+    mutable std::mutex mutex;
+    std::ofstream stream;
+    uint64_t cursor;
+    std::vector<ArchiveEntry> entries;
+    std::unordered_map<std::string, size_t> names;
+    bool finished;
+};
+
+// Reads an archive. Opening it reads the header, the trailer and the index only. The images
+// are read in place from the mapping when the file can be mapped; otherwise each one is read
+// from the file when it is asked for, so an archive is never loaded whole. Any number of
+// threads may read and decode entries of one reader at once, each with a Decoder of its own.
+class ArchiveReader
+{
+public:
+    explicit ArchiveReader(const std::string &file_name, const bool allow_mapping = true);
+    ~ArchiveReader();
+
+    ArchiveReader(const ArchiveReader&) = delete;
+    void operator=(const ArchiveReader&) = delete;
+
+    const std::vector<ArchiveEntry> &entries() const { return index; }
+
+    // Index of the entry with this name, -1 when there is none.
+    int find(const std::string &name) const;
+
+    bool is_mapped() const { return file != nullptr; }
+
+    // The .barch image of an entry in place, for read_barch_info(), decompress_buffer() or a
+    // Decoder. nullptr when the archive isn't mapped, read() copies it out either way.
+    const unsigned char *data(const ArchiveEntry &entry) const;
+
+    // Reads the .barch image of an entry into `image`.
+    void read(const ArchiveEntry &entry, std::vector<unsigned char> &image) const;
+
+    // Decodes an entry into a file laid out as the decoder's options say.
+    void extract(const ArchiveEntry &entry, const std::string &file_name_out, Decoder &decoder) const;
+
+private:
+    bool read_at(const uint64_t offset, void *out, const size_t size) const;
+
+    std::unique_ptr<MappedFile> file;
+    mutable std::mutex mutex; // of the stream
+    mutable std::ifstream stream;
+    uint64_t file_size;
+    std::vector<ArchiveEntry> index;
+    std::unordered_map<std::string, size_t> names;
+};
+
+#endif // ARCHIVE_H
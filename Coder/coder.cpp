@@ -1,407 +1,2643 @@
-#include "coder.h"
-
-#include <iostream>
-
-#include <fstream>
-#include <vector>
-#include <iostream>
-#include <memory>
-#include <bitset>
-
-#pragma pack(push, 1)
-struct BMPFileHeader {
-    uint16_t file_type{0x4D42};          // File type always BM which is 0x4D42
-    uint32_t file_size{0};               // Size of the file (in bytes)
-    uint16_t reserved1{0};               // Reserved, always 0
-    uint16_t reserved2{0};               // Reserved, always 0
-    uint32_t offset_data{0};             // Start position of pixel data (bytes from the beginning of the file)
-};
-
-struct BMPInfoHeader {
-    uint32_t size{ 0 };                      // Size of this header (in bytes)
-    int32_t width{ 0 };                      // width of bitmap in pixels
-    int32_t height{ 0 };                     // width of bitmap in pixels
-                                             //       (if positive, bottom-up, with origin in lower left corner)
-                                             //       (if negative, top-down, with origin in upper left corner)
-    uint16_t planes{ 1 };                    // No. of planes for the target device, this is always 1
-    uint16_t bit_count{ 0 };                 // No. of bits per pixel
-    uint32_t compression{ 0 };               // 0 or 3 - uncompressed. THIS PROGRAM CONSIDERS ONLY UNCOMPRESSED BMP images
-    uint32_t size_image{ 0 };                // 0 - for uncompressed images
-    int32_t x_pixels_per_meter{ 0 };
-    int32_t y_pixels_per_meter{ 0 };
-    uint32_t colors_used{ 0 };               // No. color indexes in the color table. Use 0 for the max number of colors allowed by bit_count
-    uint32_t colors_important{ 0 };          // No. of colors used for displaying the bitmap. If 0 all colors are required
-};
-
-struct BMPColorHeader {
-    uint32_t red_mask{ 0x00ff0000 };         // Bit mask for the red channel
-    uint32_t green_mask{ 0x0000ff00 };       // Bit mask for the green channel
-    uint32_t blue_mask{ 0x000000ff };        // Bit mask for the blue channel
-    uint32_t alpha_mask{ 0xff000000 };       // Bit mask for the alpha channel
-    uint32_t color_space_type{ 0x73524742 }; // Default "sRGB" (0x73524742)
-    uint32_t unused[16]{ 0 };                // Unused data for sRGB color space
-};
-
-struct BMPOutFile {
-    BMPOutFile()
-        : width(0)
-        , height(0)
-        , data(nullptr)
-    {}
-    ~BMPOutFile()
-    {
-        if (data)
-        {
-            delete [] data;
-        }
-    }
-    BMPOutFile( const BMPOutFile& ) = delete;
-    void operator=( const BMPOutFile& ) = delete;
-
-    unsigned int width; // bitmap width in pixels
-    unsigned int height; // bitmap height in pixels
-    unsigned char * data; // Pointer to bitmap data. data[j * width + i] is color of pixel in row j and column i.
-};
-
-#pragma pack(pop)
-
-uint32_t make_stride_aligned(const uint32_t align_stride, const uint32_t old_row_stride) {
-    uint32_t new_stride = old_row_stride;
-    while (new_stride % align_stride != 0) {
-        new_stride++;
-    }
-    return new_stride;
-}
-
-std::shared_ptr<BMPOutFile> read_bmp(const std::string &file_name)
-{
-    std::shared_ptr<BMPOutFile> data = std::make_shared<BMPOutFile>();
-    std::ifstream inp{ file_name, std::ios_base::binary };
-    if (inp) {
-        BMPFileHeader file_header;
-        BMPInfoHeader bmp_info_header;
-        BMPColorHeader bmp_color_header;
-
-
-        inp.read((char*)&file_header, sizeof(file_header));
-        if(file_header.file_type != 0x4D42) {
-            throw std::runtime_error("Error! Unrecognized file format.");
-        }
-        inp.read((char*)&bmp_info_header, sizeof(bmp_info_header));
-        if(bmp_info_header.bit_count != 8) {
-            std::cerr << "Warning! The file \"" << file_name << "\" does not supported for comppression!";
-            throw std::runtime_error("Error! Unrecognized file format.");
-        }
-;
-        // Jump to the pixel data location
-        inp.seekg(file_header.offset_data, inp.beg);
-
-        // Adjust the header fields for output.
-        // Some editors will put extra info in the image file, we only save the headers and the data.
-        if(bmp_info_header.bit_count == 32) {
-            bmp_info_header.size = sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
-            file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
-        } else {
-            bmp_info_header.size = sizeof(BMPInfoHeader);
-            file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
-        }
-        file_header.file_size = file_header.offset_data;
-
-        if (bmp_info_header.height < 0) {
-            throw std::runtime_error("The program can treat only BMP images with the origin in the bottom left corner!");
-        }
-
-        data->width = bmp_info_header.width;
-        data->height = bmp_info_header.height;
-
-        int data_size = bmp_info_header.width * bmp_info_header.height * bmp_info_header.bit_count / 8;
-        data->data = new unsigned char[data_size];
-
-        // Here we check if we need to take into account row padding
-        if (bmp_info_header.width % 4 == 0) {
-            inp.read((char*)data->data, data_size);
-            file_header.file_size += data_size;
-        }
-        else {
-            uint32_t row_stride{ static_cast<uint32_t>(bmp_info_header.width) };
-            std::vector<uint8_t> padding_row(make_stride_aligned(4, row_stride) - row_stride);
-            for (int y = 0; y < bmp_info_header.height; ++y) {
-                inp.read((char*)(data->data + row_stride * y), row_stride);
-                inp.read((char*)padding_row.data(), padding_row.size());
-            }
-            file_header.file_size += data_size + bmp_info_header.height * padding_row.size();
-        }
-    }
-    else {
-        std::cerr << "Can't open file: " << file_name << std::endl;
-        throw std::runtime_error("Unable to open the input image file.");
-    }
-    return data;
-}
-
-int compress(const std::string &file_name_in, const std::string &file_name_out)
-{
-    std::string out_file_data;
-
-    uint16_t row_size = 0;
-    std::string row_data;
-    bool is_row_empty = false;
-
-    uint16_t buffer_it = 0;
-    uint16_t buffer;
-
-    enum class Values
-    {
-        White,
-        Black,
-        White4,
-        Black4
-    };
-
-    auto writeToRow = [&row_data, &buffer, &buffer_it]()
-    {
-        char byte = static_cast<char>(buffer);
-        row_data += byte;
-        buffer = buffer >> 8; // possible issue
-        buffer_it -= 8;
-    };
-    auto writeToBuffer = [&buffer, &buffer_it, writeToRow](const Values data, const int count)
-    {
-        for (int it = 0; it < count; ++it)
-        {
-            switch (data) {
-            case Values::White : {
-                buffer |= (1 << buffer_it++);// true
-                buffer |= (1 << buffer_it++);
-                buffer &= ~(1 << buffer_it++);// false
-            } break;
-            case Values::Black : {
-                buffer |= (1 << buffer_it++);
-                buffer |= (1 << buffer_it++);
-                buffer |= (1 << buffer_it++);
-            } break;
-            case Values::White4 : {
-                buffer &= ~(1 << buffer_it++);
-            } break;
-            case Values::Black4 : {
-                buffer |= (1 << buffer_it++);
-                buffer &= ~(1 << buffer_it++);
-            } break;
-            }
-        }
-        if (buffer_it > 7)
-        {
-            writeToRow();
-        }
-    };
-
-    const auto data = read_bmp(file_name_in);
-    std::cout << "Data size: " << data->width << " X " << data->height << std::endl;
-    for (int i = 0; i < data->height; ++i)
-    {
-        is_row_empty = true;
-        row_data.clear();
-        buffer = 0;
-        buffer_it = 0;
-
-        bool current_color_white = false;
-        int count = 0;
-        for (int j = 0; j < data->width; ++j)
-        {
-            if (data->data[j * data->width + i] == 0xff)
-            {// white
-                if (current_color_white)
-                {
-                    ++count;
-                    if (count == 4)// change to const or macros
-                    {
-                        writeToBuffer(Values::White4, 1);
-                        count = 0;
-                    }
-                }
-                else
-                {
-                    is_row_empty = false;
-                    writeToBuffer(Values::Black, count);
-                    current_color_white = true;
-                    count = 1;
-                }
-            }
-            else
-            {// black
-                is_row_empty = false;
-                if (!current_color_white)
-                {
-                    ++count;
-                    if (count == 4)// change to const or macros
-                    {
-                        writeToBuffer(Values::Black4, 1);
-                        count = 0;
-                    }
-                }
-                else
-                {
-                    writeToBuffer(Values::White, count);
-                    current_color_white = false;
-                    count = 1;
-                }
-            }
-        }
-        if (buffer_it > 0)
-        {
-            writeToRow();
-        }
-        row_size = 0;
-        if (is_row_empty)
-        {
-            std::cerr << "Empty" << std::endl;
-            // zero 16 bit
-            out_file_data.append((const char*)&row_size, 2);
-        }
-        else
-        {
-            row_size = row_data.size();
-            out_file_data.append((const char*)&row_size, 2);
-            out_file_data.append(row_data);
-        }
-    }
-
-    std::ofstream onp{ file_name_out, std::ios_base::binary };
-    if (onp.is_open())
-    {
-        /*onp.write((const char*)&data->header_size, 4);
-        onp.write((const char*)&data->header, data->header_size);*/
-        uint16_t width = data->width;
-        uint16_t height = data->height;
-        onp.write((const char*)&width, 2);
-        onp.write((const char*)&height, 2);
-        onp.write(out_file_data.c_str(), out_file_data.size());
-        onp.flush();
-        onp.close();
-        std::cout << "wrote the file successfully! " << file_name_out << std::endl;
-    }
-    else
-    {
-        std::cerr << "Can't open file: " << file_name_out << std::endl;
-        throw std::runtime_error("Unable to open the output image file.");
-    }
-    return 0;
-}
-
-int decompress(const std::string &file_name_in, const std::string &file_name_out)
-{
-    std::ifstream inp{ file_name_in, std::ios_base::binary };
-    if (inp) {
-        std::shared_ptr<BMPOutFile> data = std::make_shared<BMPOutFile>();
-        inp.read((char*)&(data->width), 2);
-        inp.read((char*)&(data->height), 2);
-
-        auto genNextBit = [](const unsigned char* data, unsigned int &byte_it, unsigned int &bit_it) -> bool
-        {
-            const unsigned char byt = data[byte_it];
-            bool value = static_cast<bool>(byt & (1 << bit_it));
-            ++bit_it;
-            if (bit_it == 8)
-            {
-                ++byte_it;
-                bit_it = 0;
-            }
-            return value;
-        };
-        const unsigned int out_width = static_cast<unsigned int>(data->width);
-        const uint32_t alligned_width = make_stride_aligned(4, out_width);
-        const auto padding = alligned_width - out_width;
-        const unsigned int data_size = alligned_width * data->height;
-        data->data = new unsigned char[data_size];
-        for (unsigned int i = 0; i < data->height; ++i)
-        {
-            uint16_t row_width = 0;
-            inp.read((char*)&row_width, 2);
-
-            const unsigned int row_base_it = i * alligned_width;
-            if (row_width == 0)
-            {// empty row
-                for (unsigned int j = 0; j < out_width; ++j)
-                {
-                    data->data[row_base_it + j] = 0xff;
-                }
-            }
-            else
-            {
-                unsigned char* row_data = new unsigned char[static_cast<unsigned int>(row_width)];
-                inp.read((char*)row_data, row_width);
-                unsigned int out_it = 0;
-                unsigned int byte_it = 0;
-                unsigned int bit_it = 0;
-                while (out_it < out_width && byte_it < row_width)
-                {
-                    if (genNextBit(row_data, byte_it, bit_it))
-                    {
-                        if (genNextBit(row_data, byte_it, bit_it))
-                        {
-                            if (genNextBit(row_data, byte_it, bit_it))
-                            {
-                                data->data[row_base_it + out_it++] = 0x00;
-                            }
-                            else
-                            {
-                                data->data[row_base_it + out_it++] = 0xff;
-                            }
-                        }
-                        else
-                        {// 4 black
-                            data->data[row_base_it + out_it++] = 0x00;
-                            data->data[row_base_it + out_it++] = 0x00;
-                            data->data[row_base_it + out_it++] = 0x00;
-                            data->data[row_base_it + out_it++] = 0x00;
-                        }
-                    }
-                    else
-                    {// 4 white
-                        data->data[row_base_it + out_it++] = 0xff;
-                        data->data[row_base_it + out_it++] = 0xff;
-                        data->data[row_base_it + out_it++] = 0xff;
-                        data->data[row_base_it + out_it++] = 0xff;
-                    }
-                }
-                if (out_it < out_width || byte_it < row_width)
-                {
-                    std::cerr << "Bad: row: " << i << " width(it, size): " << out_it << " " << out_width << " in row(it, size): " << byte_it << " " << row_width << std::endl;
-                }
-                delete [] row_data;
-                row_data = nullptr;
-            }
-        }
-        BMPFileHeader header;
-        header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof (BMPColorHeader);
-        header.file_size = header.offset_data + data_size;
-
-        BMPInfoHeader info;
-        info.size = sizeof(BMPInfoHeader);
-        info.width = data->width;
-        info.height = data->height;
-        info.bit_count = 8;
-        info.size_image = data_size;
-
-        BMPColorHeader colors;
-
-        std::ofstream onp{ file_name_out, std::ios_base::binary };
-        if (onp.is_open())
-        {
-            onp.write((const char*)&header, sizeof(BMPFileHeader));
-            onp.write((const char*)&info, sizeof(BMPInfoHeader));
-            onp.write((const char*)&colors, sizeof(BMPColorHeader));
-            onp.write((const char*)(data->data), header.file_size);
-            onp.flush();
-            onp.close();
-            std::cout << "wrote the file successfully! " << file_name_out << std::endl;
-        }
-        else
-        {
-            std::cerr << "Can't open file: " << file_name_out << std::endl;
-            throw std::runtime_error("Unable to open the output image file.");
-        }
-    }
-    return 0;
-}
-
+#include "coder.h"
+#include "mappedfile.h"
+#include "resultcache.h"
+#include "rowscan.h"
+#include "stagethread.h"
+#include "workerpool.h"
+
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <bitset>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#pragma pack(push, 1)
+struct BMPFileHeader {
+    uint16_t file_type{0x4D42};          // File type always BM which is 0x4D42
+    uint32_t file_size{0};               // Size of the file (in bytes)
+    uint16_t reserved1{0};               // Reserved, always 0
+    uint16_t reserved2{0};               // Reserved, always 0
+    uint32_t offset_data{0};             // Start position of pixel data (bytes from the beginning of the file)
+};
+
+struct BMPInfoHeader {
+    uint32_t size{ 0 };                      // Size of this header (in bytes)
+    int32_t width{ 0 };                      // width of bitmap in pixels
+    int32_t height{ 0 };                     // width of bitmap in pixels
+                                             //       (if positive, bottom-up, with origin in lower left corner)
+                                             //       (if negative, top-down, with origin in upper left corner)
+    uint16_t planes{ 1 };                    // No. of planes for the target device, this is always 1
+    uint16_t bit_count{ 0 };                 // No. of bits per pixel
+    uint32_t compression{ 0 };               // 0 or 3 - uncompressed. THIS PROGRAM CONSIDERS ONLY UNCOMPRESSED BMP images
+    uint32_t size_image{ 0 };                // 0 - for uncompressed images
+    int32_t x_pixels_per_meter{ 0 };
+    int32_t y_pixels_per_meter{ 0 };
+    uint32_t colors_used{ 0 };               // No. color indexes in the color table. Use 0 for the max number of colors allowed by bit_count
+    uint32_t colors_important{ 0 };          // No. of colors used for displaying the bitmap. If 0 all colors are required
+};
+
+struct BMPColorHeader {
+    uint32_t red_mask{ 0x00ff0000 };         // Bit mask for the red channel
+    uint32_t green_mask{ 0x0000ff00 };       // Bit mask for the green channel
+    uint32_t blue_mask{ 0x000000ff };        // Bit mask for the blue channel
+    uint32_t alpha_mask{ 0xff000000 };       // Bit mask for the alpha channel
+    uint32_t color_space_type{ 0x73524742 }; // Default "sRGB" (0x73524742)
+    uint32_t unused[16]{ 0 };                // Unused data for sRGB color space
+};
+
+// Header of a .barch v2 file. It is followed by band_count + 1 offsets (uint64_t) of the
+// bands from the end of the offset table, the last one being the size of the row data, and
+// then by the rows themselves, each with its 16-bit size prefix as in v1, or a varint size
+// with barch_flag_wide_rows. With barch_flag_row_modes every non-empty row starts with a
+// RowMode byte.
+struct BarchHeader {
+    uint32_t magic{ 0x48435242 };            // "BRCH"
+    uint16_t version{ 2 };
+    uint16_t flags{ 0 };                     // barch_flag_* bits
+    uint32_t width{ 0 };                     // bitmap width in pixels
+    uint32_t height{ 0 };                    // bitmap height in pixels
+    uint32_t band_rows{ 0 };                 // rows per band, the last band may be shorter
+    uint32_t band_count{ 0 };
+};
+
+#pragma pack(pop)
+
+const uint32_t barch_magic = 0x48435242;
+const unsigned int barch_band_rows = 64;
+
+// Row sizes are LEB128 varints of up to 5 bytes instead of uint16_t.
+const uint16_t barch_flag_wide_rows = 0x0001;
+// Rows pick their own coding, see RowMode.
+const uint16_t barch_flag_row_modes = 0x0002;
+const uint16_t barch_known_flags = barch_flag_wide_rows | barch_flag_row_modes;
+
+// How a row is coded when the image has barch_flag_row_modes.
+enum class RowMode : unsigned char
+{
+    Codes, // the v1 bit codes
+    Runs,  // varint run lengths, white first, the pixels past the last run are white
+    Delta  // varint lengths of alternately unchanged and flipped pixels against the previous
+           // row of the band, the pixels past the last one are unchanged as well, so a
+           // trailing unchanged run is left out and no lengths at all repeat that row
+};
+
+uint32_t make_stride_aligned(const uint32_t align_stride, const uint32_t old_row_stride) {
+    uint32_t new_stride = old_row_stride;
+    while (new_stride % align_stride != 0) {
+        new_stride++;
+    }
+    return new_stride;
+}
+
+// Rows of a bitmap being compressed, handed out a window at a time so memory use doesn't grow
+// with the image. A mapped file hands out pointers into the mapping, faulting the pages in
+// on load() and dropping them on release(), otherwise every window is read into a buffer of
+// the caller's. Rows keep their padding and their pixel format, and are stride() bytes apart;
+// row 0 is the bottom one, so the stride is negative for top-down bitmaps. Once constructed,
+// load() and release() may run on a different thread than the rest of the encoder.
+class BitmapSource
+{
+public:
+    BitmapSource(const std::string &file_name, const bool allow_mapping)
+        : file_size(0)
+        , pixel_offset(0)
+        , bitmap_width(0)
+        , bitmap_height(0)
+        , row_stride(0)
+        , top_down(false)
+        , pixel_format(PixelFormat::Gray8)
+        , hasher(nullptr)
+        , hashed(0)
+    {
+        if (allow_mapping)
+        {
+            file = std::make_shared<MappedFile>(file_name, true, false);
+        }
+        if (file && file->is_mapped())
+        {
+            file_size = file->size();
+        }
+        else
+        {
+            file.reset();
+            stream.open(file_name, std::ios_base::binary | std::ios_base::ate);
+            if (!stream) {
+                throw std::runtime_error("Unable to open the input image file.");
+            }
+            file_size = static_cast<uint64_t>(stream.tellg());
+            stream.seekg(0, stream.beg);
+        }
+
+        BMPFileHeader file_header;
+        BMPInfoHeader bmp_info_header;
+        if (!read(0, &file_header, sizeof(file_header)) || file_header.file_type != 0x4D42
+                || !read(sizeof(file_header), &bmp_info_header, sizeof(bmp_info_header))) {
+            throw std::runtime_error("Error! Unrecognized file format.");
+        }
+        switch (bmp_info_header.bit_count) {
+        case 1: {// the brighter palette entry is white
+            unsigned char palette[8];
+            if (!read(sizeof(file_header) + static_cast<uint64_t>(bmp_info_header.size), palette, sizeof(palette))) {
+                throw std::runtime_error("Error! The bitmap palette is truncated.");
+            }
+            const unsigned int bright0 = palette[0] + palette[1] + palette[2];
+            const unsigned int bright1 = palette[4] + palette[5] + palette[6];
+            pixel_format = bright1 >= bright0 ? PixelFormat::Mono1 : PixelFormat::Mono1Inverted;
+        } break;
+        case 8: pixel_format = PixelFormat::Gray8; break;
+        case 24: pixel_format = PixelFormat::Bgr24; break;
+        case 32: pixel_format = PixelFormat::Bgra32; break;
+        default:
+            throw std::runtime_error("Error! Unrecognized file format.");
+        }
+        if (bmp_info_header.compression != 0 && !(bmp_info_header.compression == 3 && bmp_info_header.bit_count == 32)) {
+            throw std::runtime_error("Error! Compressed BMP images are not supported.");
+        }
+        if (bmp_info_header.width < 0 || bmp_info_header.height == std::numeric_limits<int32_t>::min()) {
+            throw std::runtime_error("Error! Unrecognized file format.");
+        }
+
+        // Rows are padded to 4 bytes in the file, the padding is skipped through the stride.
+        top_down = bmp_info_header.height < 0;
+        bitmap_width = bmp_info_header.width;
+        bitmap_height = top_down ? -bmp_info_header.height : bmp_info_header.height;
+        row_stride = (row_bytes(bitmap_width, pixel_format) + 3) & ~size_t(3);
+        pixel_offset = file_header.offset_data;
+        if (pixel_offset > file_size || (file_size - pixel_offset) / std::max<uint64_t>(row_stride, 1) < bitmap_height) {
+            throw std::runtime_error("Error! The bitmap data is truncated.");
+        }
+    }
+
+    unsigned int width() const { return bitmap_width; }
+    unsigned int height() const { return bitmap_height; }
+    ptrdiff_t stride() const { return top_down ? -static_cast<ptrdiff_t>(row_stride) : static_cast<ptrdiff_t>(row_stride); }
+    PixelFormat format() const { return pixel_format; }
+
+    // Makes rows [first_row, last_row) available and returns row first_row, the pointer stays
+    // valid until the rows are released or the window is loaded again.
+    const unsigned char *load(const unsigned int first_row, const unsigned int last_row,
+                              std::vector<unsigned char> &window)
+    {
+        const uint64_t first = file_offset(first_row, last_row);
+        const size_t size = (last_row - first_row) * row_stride;
+        const unsigned char *rows = nullptr;
+        if (file)
+        {
+            file->prefetch(first, size);
+            rows = file->data() + first;
+        }
+        else
+        {
+            window.resize(size);
+            stream.seekg(static_cast<std::streamoff>(first), stream.beg);
+            stream.read((char*)window.data(), window.size());
+            if (!stream) {
+                throw std::runtime_error("Error! Unable to read the bitmap data.");
+            }
+            rows = window.data();
+        }
+        if (hasher && first == hashed)
+        {
+            hasher->update(rows, size);
+            hashed += size;
+        }
+        return rows + (top_down ? (last_row - first_row - 1) * row_stride : 0);
+    }
+
+    // Hashes the file into `into` for the result cache as the rows are loaded, from the first
+    // row up. The rows of a top-down bitmap come from the end of the file first, so such a file
+    // is hashed here, before any row is coded.
+    void hash_into(ContentHasher &into)
+    {
+        hasher = &into;
+        hash_to(top_down ? file_size : pixel_offset);
+    }
+
+    // The content_hash() of the whole file once every row was loaded, false if some were not.
+    bool content_hash(uint64_t &hash)
+    {
+        if (!hasher || hashed < pixel_offset + static_cast<uint64_t>(bitmap_height) * row_stride)
+        {
+            return false;
+        }
+        hash_to(file_size); // whatever follows the rows
+        hash = hasher->value();
+        return hashed == file_size;
+    }
+
+    // Rows [first_row, last_row) are not needed any more.
+    void release(const unsigned int first_row, const unsigned int last_row)
+    {
+        if (file)
+        {
+            file->release(file_offset(first_row, last_row), (last_row - first_row) * row_stride);
+        }
+    }
+
+private:
+    // Where rows [first_row, last_row) start in the file, whichever way up they are stored.
+    uint64_t file_offset(const unsigned int first_row, const unsigned int last_row) const
+    {
+        return pixel_offset + (top_down ? bitmap_height - last_row : first_row) * static_cast<uint64_t>(row_stride);
+    }
+
+    // Hashes the bytes from where the hash stands up to `end`.
+    void hash_to(const uint64_t end)
+    {
+        if (file)
+        {
+            hasher->update(file->data() + hashed, end - hashed);
+            hashed = end;
+            return;
+        }
+        unsigned char chunk[65536];
+        while (hashed < end)
+        {
+            const size_t size = static_cast<size_t>(std::min<uint64_t>(sizeof(chunk), end - hashed));
+            if (!read(hashed, chunk, size))
+            {
+                return;
+            }
+            hasher->update(chunk, size);
+            hashed += size;
+        }
+    }
+
+    bool read(const uint64_t offset, void *out, const size_t size)
+    {
+        if (offset > file_size || file_size - offset < size)
+        {
+            return false;
+        }
+        if (file)
+        {
+            std::memcpy(out, file->data() + offset, size);
+            return true;
+        }
+        stream.seekg(static_cast<std::streamoff>(offset), stream.beg);
+        return static_cast<bool>(stream.read((char*)out, size));
+    }
+
+    std::shared_ptr<MappedFile> file;
+    std::ifstream stream;
+    uint64_t file_size;
+    uint64_t pixel_offset;
+    unsigned int bitmap_width;
+    unsigned int bitmap_height;
+    size_t row_stride;
+    bool top_down;
+    PixelFormat pixel_format;
+    ContentHasher *hasher;
+    uint64_t hashed; // bytes of the file hashed so far, from its start
+};
+
+namespace
+{
+
+enum class Values
+{
+    White,
+    Black,
+    White4,
+    Black4
+};
+
+// The .barch bit codes, least significant bit first: a 4-pixel group is 0 when white and
+// 1 0 when black, a single pixel 1 1 0 when white and 1 1 1 when black.
+struct BarchCodes
+{
+    static constexpr uint64_t group_code(const bool white) { return white ? 0x0 : 0x1; }
+    static constexpr unsigned int group_size(const bool white) { return white ? 1 : 2; }
+    static constexpr uint64_t single_code(const bool white) { return white ? 0x3 : 0x7; }
+    static constexpr unsigned int single_size() { return 3; }
+};
+
+// `count` copies of a code of `size` bits, the first one in the lowest bits.
+constexpr uint64_t repeat_code(const uint64_t code, const unsigned int size, const unsigned int count)
+{
+    return count == 0 ? 0 : code | (repeat_code(code, size, count - 1) << size);
+}
+
+// The bits RowWriter::write_run() puts for the runs of a code table, by color (0 black,
+// 1 white), made when compiling. A run is its 4-pixel groups and then the 0-3 pixels left
+// over as single codes; up to chunk_groups groups and the singles go in one put().
+template <typename Codes>
+struct RunCodes
+{
+    static constexpr unsigned int chunk_bits = 32 - 3 * Codes::single_size();
+    static constexpr unsigned int group_size[2] = { Codes::group_size(false), Codes::group_size(true) };
+    static constexpr unsigned int chunk_groups[2] = { chunk_bits / Codes::group_size(false),
+                                                      chunk_bits / Codes::group_size(true) };
+    static constexpr uint64_t groups[2] = {
+        repeat_code(Codes::group_code(false), Codes::group_size(false), chunk_bits / Codes::group_size(false)),
+        repeat_code(Codes::group_code(true), Codes::group_size(true), chunk_bits / Codes::group_size(true)) };
+    static constexpr uint64_t singles[2][4] = {
+        { 0, repeat_code(Codes::single_code(false), Codes::single_size(), 1),
+          repeat_code(Codes::single_code(false), Codes::single_size(), 2),
+          repeat_code(Codes::single_code(false), Codes::single_size(), 3) },
+        { 0, repeat_code(Codes::single_code(true), Codes::single_size(), 1),
+          repeat_code(Codes::single_code(true), Codes::single_size(), 2),
+          repeat_code(Codes::single_code(true), Codes::single_size(), 3) } };
+};
+
+template <typename Codes> constexpr unsigned int RunCodes<Codes>::chunk_bits;
+template <typename Codes> constexpr unsigned int RunCodes<Codes>::group_size[2];
+template <typename Codes> constexpr unsigned int RunCodes<Codes>::chunk_groups[2];
+template <typename Codes> constexpr uint64_t RunCodes<Codes>::groups[2];
+template <typename Codes> constexpr uint64_t RunCodes<Codes>::singles[2][4];
+
+// Accumulates prefix codes least significant bit first and spills whole bytes into the row.
+// The row must have room for row_bound() bytes.
+class RowWriter
+{
+public:
+    explicit RowWriter(unsigned char *out)
+        : begin(out)
+        , it(out)
+        , buffer(0)
+        , buffer_it(0)
+    {}
+
+    // Writes a run of `count` pixels of one color in the codes of `Codes`. A short run takes
+    // a single put() of bits looked up in RunCodes, whatever its color.
+    template <typename Codes>
+    void write_run(const bool white, const unsigned int count)
+    {
+        typedef RunCodes<Codes> Table;
+        const unsigned int color = white ? 1 : 0;
+        const unsigned int size = Table::group_size[color];
+        unsigned int groups = count / 4;
+        if (Table::groups[color] == 0 && size == 1 && groups > 64)
+        {// one zero bit per group, long spans are whole zero bytes
+            const unsigned int head = (8 - buffer_it % 8) % 8;
+            put(0, head);
+            flush_buffer();
+            groups -= head;
+            std::memset(it, 0, groups / 8);
+            it += groups / 8;
+            groups %= 8;
+        }
+        for (; groups > Table::chunk_groups[color]; groups -= Table::chunk_groups[color])
+        {
+            put(Table::groups[color], Table::chunk_groups[color] * size);
+        }
+        const unsigned int group_bits = groups * size;
+        const uint64_t group_mask = ~(~uint64_t(0) << group_bits);
+        put((Table::groups[color] & group_mask) | (Table::singles[color][count % 4] << group_bits),
+            group_bits + (count % 4) * Codes::single_size());
+    }
+
+    // Writes out the pending bits, the last byte is padded with zeros. Returns the row size.
+    size_t flush()
+    {
+        buffer_it = (buffer_it + 7) & ~7u;
+        flush_buffer();
+        return it - begin;
+    }
+
+private:
+    void put(const uint64_t bits, const unsigned int size)
+    {
+        if (size == 0)
+        {
+            return;
+        }
+        buffer |= (bits & (~uint64_t(0) >> (64 - size))) << buffer_it;
+        buffer_it += size;
+        if (buffer_it >= 32)
+        {
+            it[0] = static_cast<unsigned char>(buffer);
+            it[1] = static_cast<unsigned char>(buffer >> 8);
+            it[2] = static_cast<unsigned char>(buffer >> 16);
+            it[3] = static_cast<unsigned char>(buffer >> 24);
+            it += 4;
+            buffer >>= 32;
+            buffer_it -= 32;
+        }
+    }
+
+    // Moves every complete byte of the buffer into the row.
+    void flush_buffer()
+    {
+        while (buffer_it >= 8)
+        {
+            *it++ = static_cast<unsigned char>(buffer);
+            buffer >>= 8;
+            buffer_it -= 8;
+        }
+    }
+
+    unsigned char *begin;
+    unsigned char *it;
+    uint64_t buffer;
+    unsigned int buffer_it;
+};
+
+// Largest encoding of a row: every pixel a 3-bit single.
+size_t row_bound(const unsigned int width)
+{
+    return (static_cast<size_t>(width) * 3 + 7) / 8;
+}
+
+// How the rows of an image are stored, the v2 flags.
+struct RowFormat
+{
+    bool wide;  // varint row sizes
+    bool modes; // a RowMode byte leads every non-empty row
+};
+
+// Rows that may not fit a 16-bit size are stored with varint sizes, picked per image.
+RowFormat row_format(const unsigned int width, const CoderOptions &options)
+{
+    RowFormat format;
+    format.modes = options.version != 1 && options.row_modes;
+    format.wide = row_bound(width) + format.modes > 0xffff;
+    return format;
+}
+
+RowFormat row_format(const uint16_t flags)
+{
+    RowFormat format;
+    format.wide = (flags & barch_flag_wide_rows) != 0;
+    format.modes = (flags & barch_flag_row_modes) != 0;
+    return format;
+}
+
+// Room reserved for the size prefix of a row.
+unsigned int row_prefix_bound(const bool wide)
+{
+    return wide ? 5 : 2;
+}
+
+// Largest encoding of a band, the row size prefixes included. A row mode is only picked
+// when it is smaller than the bit codes.
+size_t band_bound(const unsigned int width, const unsigned int rows, const RowFormat &format)
+{
+    return rows * (row_prefix_bound(format.wide) + format.modes + row_bound(width));
+}
+
+unsigned int varint_size(size_t value)
+{
+    unsigned int size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+unsigned int write_varint(unsigned char *out, size_t value)
+{
+    unsigned int size = 0;
+    while (value >= 0x80)
+    {
+        out[size++] = static_cast<unsigned char>(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = static_cast<unsigned char>(value);
+    return size;
+}
+
+// Writes the bit codes of a row from its white mask, a run at a time. Every run is stored as
+// its 4-pixel groups followed by the 1-3 pixels left over. Returns the size of the codes.
+template <typename Codes>
+size_t encode_codes(const uint64_t *mask, const unsigned int width, unsigned char *out)
+{
+    RowWriter writer(out);
+    unsigned int pos = 0;
+    while (pos < width)
+    {
+        const bool white = (mask[pos / 64] >> (pos % 64)) & 1;
+        const unsigned int run_end = find_run_end(mask, pos, width, white);
+        writer.write_run<Codes>(white, run_end - pos);
+        pos = run_end;
+    }
+    return writer.flush();
+}
+
+// Writes the lengths of the runs of `mask`, starting with a run of bits equal to `first`,
+// and leaves out the last run when it has that same value. With `out` null only counts.
+size_t encode_run_lengths(const uint64_t *mask, const unsigned int width, const bool first, unsigned char *out)
+{
+    size_t size = 0;
+    unsigned int pos = 0;
+    bool value = first;
+    while (pos < width)
+    {
+        const unsigned int run_end = find_run_end(mask, pos, width, value);
+        if (run_end == width && value == first)
+        {
+            break;
+        }
+        size += out ? write_varint(out + size, run_end - pos) : varint_size(run_end - pos);
+        pos = run_end;
+        value = !value;
+    }
+    return size;
+}
+
+// Classifier policies of the band encoders, each calls one classifier directly. PureWhite
+// takes 0xff alone as white, WhiteLevel any level at or above CoderOptions::white_level.
+template <ClassifyRowFunction Classify>
+struct PureWhite
+{
+    static bool classify(const unsigned char *row, const unsigned int width, const unsigned char, uint64_t *mask)
+    {
+        return Classify(row, width, mask);
+    }
+};
+
+template <ClassifyLevelFunction Classify>
+struct WhiteLevel
+{
+    static bool classify(const unsigned char *row, const unsigned int width, const unsigned char level, uint64_t *mask)
+    {
+        return Classify(row, width, level, mask);
+    }
+};
+
+// Encodes one row of pixels and fills its white mask. Returns the size of the encoded row,
+// 0 for a fully white row, which is stored as a zero row size.
+// With row modes the row takes the smallest of its bit codes, its run lengths and its
+// difference from `previous`, the mask of the row before (null for the first row of a band);
+// `delta` is scratch room for a mask. Ties go to the mode that decodes faster.
+template <typename Classifier, bool Modes>
+size_t encode_row(const unsigned char *row, const unsigned int width, const unsigned char level, unsigned char *out,
+                  uint64_t *mask, const uint64_t *previous, uint64_t *delta)
+{
+    if (Classifier::classify(row, width, level, mask))
+    {
+        return 0;
+    }
+    if (!Modes)
+    {
+        return encode_codes<BarchCodes>(mask, width, out);
+    }
+
+    // every run length takes a byte or more, a mode with more runs than the bit codes have
+    // bytes is not worth a walk over its runs
+    RowMode mode = RowMode::Codes;
+    size_t best = encode_codes<BarchCodes>(mask, width, out + 1);
+    if (count_transitions(mask, width, true) < best)
+    {
+        const size_t runs = encode_run_lengths(mask, width, true, nullptr);
+        if (runs <= best)
+        {
+            mode = RowMode::Runs;
+            best = runs;
+        }
+    }
+    if (previous)
+    {
+        const unsigned int words = row_mask_words(width);
+        for (unsigned int it = 0; it < words; ++it)
+        {
+            delta[it] = mask[it] ^ previous[it];
+        }
+        if (count_transitions(delta, width, false) < best)
+        {
+            const size_t changes = encode_run_lengths(delta, width, false, nullptr);
+            if (changes <= best)
+            {
+                mode = RowMode::Delta;
+                best = changes;
+            }
+        }
+    }
+
+    out[0] = static_cast<unsigned char>(mode);
+    if (mode == RowMode::Runs)
+    {
+        encode_run_lengths(mask, width, true, out + 1);
+    }
+    else if (mode == RowMode::Delta)
+    {
+        encode_run_lengths(delta, width, false, out + 1);
+    }
+    return 1 + best;
+}
+
+// Rows handed to the encoder: row r starts at data + r * stride, the stride is negative for
+// bitmaps stored top-down. `encode_band` is the band encoder for their pixel format.
+struct PixelRows;
+
+typedef size_t (*EncodeBandFunction)(const PixelRows &rows, const unsigned int row_count, const bool wide,
+                                     unsigned char *out, uint64_t *scratch, RowTypeCounts &counts);
+
+struct PixelRows
+{
+    const unsigned char *data;
+    ptrdiff_t stride;
+    unsigned int width;
+    unsigned char white_level;
+    EncodeBandFunction encode_band;
+
+    const unsigned char *row(const unsigned int index) const
+    {
+        return data + static_cast<ptrdiff_t>(index) * stride;
+    }
+};
+
+// Encodes the first `row_count` rows, each with its size prefix, into out (band_bound()
+// bytes), and counts them in `counts`. Returns the size of the encoded band.
+// `scratch` is room for band_scratch_words() words. One is compiled for every classifier
+// and for rows with and without modes, band_encoder() picks one per image.
+template <typename Classifier, bool Modes>
+size_t encode_band(const PixelRows &rows, const unsigned int row_count, const bool wide, unsigned char *out,
+                   uint64_t *scratch, RowTypeCounts &counts)
+{
+    const unsigned int width = rows.width;
+    const unsigned int prefix_bound = row_prefix_bound(wide);
+    const unsigned int words = row_mask_words(width);
+    uint64_t *mask = scratch;
+    uint64_t *previous = scratch + words;
+    unsigned char *it = out;
+    for (unsigned int i = 0; i < row_count; ++i)
+    {
+        const size_t row_size = encode_row<Classifier, Modes>(rows.row(i), width, rows.white_level, it + prefix_bound,
+                                                              mask, i > 0 ? previous : nullptr, scratch + 2 * words);
+        std::swap(mask, previous);
+        if (row_size == 0)
+        {
+            ++counts.empty;
+        }
+        else if (!Modes)
+        {
+            ++counts.codes;
+        }
+        else
+        {
+            switch (static_cast<RowMode>(it[prefix_bound]))
+            {
+            case RowMode::Codes : ++counts.codes; break;
+            case RowMode::Runs : ++counts.runs; break;
+            case RowMode::Delta : ++counts.delta; break;
+            }
+        }
+        if (!wide)
+        {
+            const uint16_t size16 = static_cast<uint16_t>(row_size);
+            std::memcpy(it, &size16, 2);
+            it += 2 + row_size;
+        }
+        else
+        {// the varint is mostly shorter than the room left for it, the row moves up behind it
+            const unsigned int prefix = write_varint(it, row_size);
+            std::memmove(it + prefix, it + prefix_bound, row_size);
+            it += prefix + row_size;
+        }
+    }
+    return it - out;
+}
+
+template <typename Classifier>
+EncodeBandFunction band_encoder(const bool modes)
+{
+    return modes ? encode_band<Classifier, true> : encode_band<Classifier, false>;
+}
+
+// The band encoder for rows of `format`, built around the fastest classifier the running CPU
+// has. It is picked once per image, a row costs a direct call to the classifier and nothing
+// is decided per pixel or per run.
+EncodeBandFunction band_encoder(const PixelFormat format, const unsigned int white_level, const bool modes)
+{
+    if (white_level > 0xff)
+    {
+        throw std::runtime_error("Error! The white level must be 0 to 255.");
+    }
+    const bool pure = white_level == 0xff;
+    const SimdLevel simd = simd_level();
+    switch (format)
+    {
+    case PixelFormat::Mono1 : return band_encoder<PureWhite<classify_row_mono1>>(modes);
+    case PixelFormat::Mono1Inverted : return band_encoder<PureWhite<classify_row_mono1_inverted>>(modes);
+    case PixelFormat::Bgr24 :
+        return !pure ? band_encoder<WhiteLevel<classify_row_bgr24_level>>(modes)
+             : simd != SimdLevel::Scalar ? band_encoder<PureWhite<classify_row_bgr24_sse2>>(modes)
+             : band_encoder<PureWhite<classify_row_bgr24_scalar>>(modes);
+    case PixelFormat::Bgra32 :
+        return !pure ? band_encoder<WhiteLevel<classify_row_bgra32_level>>(modes)
+             : simd == SimdLevel::Avx2 ? band_encoder<PureWhite<classify_row_bgra32_avx2>>(modes)
+             : simd == SimdLevel::Sse2 ? band_encoder<PureWhite<classify_row_bgra32_sse2>>(modes)
+             : band_encoder<PureWhite<classify_row_bgra32_scalar>>(modes);
+    case PixelFormat::Gray8 : break;
+    }
+    if (!pure)
+    {
+        return simd != SimdLevel::Scalar ? band_encoder<WhiteLevel<classify_row_gray8_level_sse2>>(modes)
+                                         : band_encoder<WhiteLevel<classify_row_gray8_level_scalar>>(modes);
+    }
+    return simd == SimdLevel::Avx2 ? band_encoder<PureWhite<classify_row_avx2>>(modes)
+         : simd == SimdLevel::Sse2 ? band_encoder<PureWhite<classify_row_sse2>>(modes)
+         : band_encoder<PureWhite<classify_row_scalar>>(modes);
+}
+
+unsigned int resolve_threads(const unsigned int threads)
+{
+    if (threads > 0)
+    {
+        return threads;
+    }
+    const unsigned int hardware = std::thread::hardware_concurrency();
+    return hardware > 0 ? hardware : 1;
+}
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(const Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Ends a stage that began at `start`: adds its time to `total` and reports it to the trace sink.
+void end_stage(const CoderOptions &options, const CoderStage stage, const unsigned int window,
+               const Clock::time_point start, const uint64_t bytes, double &total)
+{
+    const double seconds = seconds_since(start);
+    total += seconds;
+    if (options.trace)
+    {
+        options.trace(TraceEvent{ stage, window, start, seconds, bytes });
+    }
+}
+
+// Throws CoderCancelled once the caller has asked to stop.
+void check_cancel(const std::atomic<bool> *cancel)
+{
+    if (cancel && cancel->load(std::memory_order_relaxed))
+    {
+        throw CoderCancelled();
+    }
+}
+
+// Everything in the options that changes the bytes a file call writes, the rest (threads,
+// mapping, tracing) only changes how fast it gets there.
+uint32_t cache_key(const CoderOptions &options, const bool compressing)
+{
+    return compressing ? 0x100u | (options.version << 1) | (options.row_modes ? 1u : 0u)
+                         | ((0xffu - (options.white_level & 0xff)) << 16)
+                       : 0x200u | static_cast<uint32_t>(options.output_format);
+}
+
+// True when the cache of the options says the output of the call is already up to date.
+bool cached_output(const CoderOptions &options, const bool compressing, const std::string &file_name_in,
+                   const std::string &file_name_out, const Clock::time_point start, CoderStats &stats)
+{
+    if (!options.cache || !options.cache->lookup(file_name_in, file_name_out, cache_key(options, compressing)))
+    {
+        return false;
+    }
+    stats.cached = true;
+    stats.total_seconds = seconds_since(start);
+    return true;
+}
+
+// The output file of a call. It is removed again unless the call gets to keep() it, so a call
+// that fails or is cancelled half way leaves nothing behind.
+class OutputFile
+{
+public:
+    explicit OutputFile(const std::string &file_name)
+        : stream(file_name, std::ios_base::binary)
+        , name(file_name)
+        , kept(false)
+    {
+        if (!stream.is_open())
+        {
+            throw std::runtime_error("Unable to open the output image file.");
+        }
+    }
+
+    ~OutputFile()
+    {
+        if (!kept)
+        {
+            stream.close();
+            std::remove(name.c_str());
+        }
+    }
+
+    OutputFile(const OutputFile&) = delete;
+    void operator=(const OutputFile&) = delete;
+
+    // Flushes and closes the file and keeps it.
+    void keep()
+    {
+        stream.flush();
+        stream.close();
+        if (!stream)
+        {
+            throw std::runtime_error("Unable to write the output image file.");
+        }
+        kept = true;
+    }
+
+    std::ofstream stream;
+
+private:
+    std::string name;
+    bool kept;
+};
+
+// Two bands per worker are encoded at a time, so memory use depends on the width and the
+// thread count, not on the height.
+const unsigned int max_window_bands = 256;
+
+unsigned int window_bands(const unsigned int threads)
+{
+    return std::min(threads * 2, max_window_bands);
+}
+
+// Scratch memory of the encoder workers, three row masks each: the current row, the row
+// before and their difference.
+typedef std::vector<std::vector<uint64_t>> RowMasks;
+
+size_t band_scratch_words(const unsigned int width)
+{
+    return 3 * static_cast<size_t>(row_mask_words(width));
+}
+
+// Encodes the bands of rows [first_row, last_row) side by side, band `it` into
+// out + it * band_bound(), and stores its size in sizes[it]. `rows` starts at first_row.
+// The rows are added to `counts`. `cancel` is checked before every band.
+void encode_window(const PixelRows &rows, const unsigned int first_row, const unsigned int last_row,
+                   const RowFormat &format, WorkerPool &pool, RowMasks &masks, unsigned char *out, uint64_t *sizes,
+                   RowTypeCounts &counts, const std::atomic<bool> *cancel)
+{
+    const unsigned int width = rows.width;
+    const unsigned int bands = (last_row - first_row + barch_band_rows - 1) / barch_band_rows;
+    const size_t bound = band_bound(width, barch_band_rows, format);
+    masks.resize(pool.size());
+    for (auto &mask : masks)
+    {
+        mask.resize(band_scratch_words(width));
+    }
+    std::mutex counts_mutex;
+    auto job = [&](const unsigned int it, const unsigned int worker)
+    {
+        check_cancel(cancel);
+        const unsigned int band_first_row = first_row + it * barch_band_rows;
+        const unsigned int band_last_row = std::min(band_first_row + barch_band_rows, last_row);
+        PixelRows band = rows;
+        band.data = rows.row(band_first_row - first_row);
+        RowTypeCounts band_counts;
+        sizes[it] = rows.encode_band(band, band_last_row - band_first_row, format.wide, out + it * bound,
+                                     masks[worker].data(), band_counts);
+        std::lock_guard<std::mutex> lock(counts_mutex);
+        counts += band_counts;
+    };
+    pool.run(bands, job);
+}
+
+// Size of the .barch header and band table.
+size_t barch_header_size(const unsigned int height, const unsigned int version)
+{
+    if (version == 1)
+    {
+        return 4;
+    }
+    const size_t bands = (static_cast<size_t>(height) + barch_band_rows - 1) / barch_band_rows;
+    return sizeof(BarchHeader) + (bands + 1) * sizeof(uint64_t);
+}
+
+// Writes the .barch header, the band table is left for the caller. v1 only has room for
+// 16-bit dimensions, larger images need v2.
+void write_barch_header(unsigned char *out, const unsigned int width, const unsigned int height,
+                        const CoderOptions &options)
+{
+    if (options.version == 1)
+    {
+        if (width > 0xffff || height > 0xffff)
+        {
+            throw std::runtime_error("Error! The image is too large for a v1 .barch file.");
+        }
+        const uint16_t dimensions[2] = { static_cast<uint16_t>(width), static_cast<uint16_t>(height) };
+        std::memcpy(out, dimensions, sizeof(dimensions));
+        return;
+    }
+    BarchHeader header;
+    header.width = width;
+    header.height = height;
+    header.band_rows = barch_band_rows;
+    header.band_count = (height + barch_band_rows - 1) / barch_band_rows;
+    const RowFormat format = row_format(width, options);
+    header.flags = (format.wide ? barch_flag_wide_rows : 0) | (format.modes ? barch_flag_row_modes : 0);
+    std::memcpy(out, &header, sizeof(BarchHeader));
+}
+
+// Destination of compress_buffer(): a caller-supplied block or a growing vector.
+class OutputArea
+{
+public:
+    OutputArea(unsigned char *data, const size_t capacity)
+        : vector(nullptr)
+        , data(data)
+        , capacity(capacity)
+    {}
+
+    explicit OutputArea(std::vector<unsigned char> &vector)
+        : vector(&vector)
+        , data(nullptr)
+        , capacity(0)
+    {}
+
+    // Makes the first `size` bytes available, the returned pointer may move on every call.
+    unsigned char *ensure(const size_t size)
+    {
+        if (vector)
+        {
+            if (vector->size() < size)
+            {
+                vector->resize(size);
+            }
+            return vector->data();
+        }
+        if (size > capacity)
+        {
+            throw std::length_error("The output buffer is too small for the compressed image.");
+        }
+        return data;
+    }
+
+    void finish(const size_t size)
+    {
+        if (vector)
+        {
+            vector->resize(size);
+        }
+    }
+
+private:
+    std::vector<unsigned char> *vector;
+    unsigned char *data;
+    size_t capacity;
+};
+
+// Encodes the image straight into the output: every window of bands is encoded past the
+// output written so far and then packed down to close the gaps between the bands. The band
+// offsets go right into the band table, so nothing but the output is allocated.
+size_t compress_to(const PixelSpan &pixels, OutputArea &area, const CoderOptions &options, WorkerPool &pool,
+                   RowMasks &masks, CoderStats &stats)
+{
+    const Clock::time_point start = Clock::now();
+    stats = CoderStats();
+    const unsigned int bands = (pixels.height + barch_band_rows - 1) / barch_band_rows;
+    const size_t header_size = barch_header_size(pixels.height, options.version);
+    unsigned char *out = area.ensure(header_size);
+    write_barch_header(out, pixels.width, pixels.height, options);
+
+    const unsigned int threads = pool.size();
+    const RowFormat format = row_format(pixels.width, options);
+    const size_t bound = band_bound(pixels.width, barch_band_rows, format);
+    const EncodeBandFunction encoder = band_encoder(pixels.format, options.white_level, format.modes);
+    size_t cursor = header_size;
+    uint64_t offset = 0;
+    uint64_t sizes[max_window_bands];
+    if (options.version != 1)
+    {
+        std::memcpy(out + sizeof(BarchHeader), &offset, sizeof(offset));
+    }
+    for (unsigned int first_band = 0; first_band < bands; first_band += window_bands(threads))
+    {
+        const unsigned int last_band = std::min(first_band + window_bands(threads), bands);
+        const unsigned int first_row = first_band * barch_band_rows;
+        const unsigned int last_row = std::min(last_band * barch_band_rows, pixels.height);
+        out = area.ensure(cursor + (last_band - first_band) * bound);
+        unsigned char *const window = out + cursor;
+        const PixelRows rows = { pixels.data + static_cast<ptrdiff_t>(first_row) * static_cast<ptrdiff_t>(pixels.stride),
+                                 static_cast<ptrdiff_t>(pixels.stride), pixels.width,
+                                 static_cast<unsigned char>(options.white_level), encoder };
+        const Clock::time_point encode_start = Clock::now();
+        encode_window(rows, first_row, last_row, format, pool, masks, window, sizes, stats.rows, nullptr);
+        uint64_t window_size = 0;
+        for (unsigned int it = 0; it < last_band - first_band; ++it)
+        {
+            window_size += sizes[it];
+        }
+        end_stage(options, CoderStage::Encode, first_band / window_bands(threads), encode_start, window_size,
+                  stats.encode_seconds);
+        for (unsigned int it = 0; it < last_band - first_band; ++it)
+        {
+            std::memmove(out + cursor, window + it * bound, sizes[it]);
+            cursor += sizes[it];
+            offset += sizes[it];
+            if (options.version != 1)
+            {
+                std::memcpy(out + sizeof(BarchHeader) + (first_band + it + 1) * sizeof(uint64_t), &offset, sizeof(offset));
+            }
+        }
+    }
+    area.finish(cursor);
+    stats.bytes_in = row_bytes(pixels.width, pixels.format) * pixels.height;
+    stats.bytes_out = cursor;
+    stats.total_seconds = seconds_since(start);
+    return cursor;
+}
+
+} // namespace
+
+Encoder::Encoder(const CoderOptions &options)
+    : options(options)
+    , pool(new WorkerPool(resolve_threads(options.threads)))
+{}
+
+Encoder::~Encoder() = default;
+
+const std::vector<unsigned char> &Encoder::compress(const PixelSpan &pixels)
+{
+    OutputArea area(output);
+    compress_to(pixels, area, options, *pool, row_masks, last_stats);
+    return output;
+}
+
+size_t Encoder::compress(const PixelSpan &pixels, unsigned char *out, const size_t capacity)
+{
+    OutputArea area(out, capacity);
+    return compress_to(pixels, area, options, *pool, row_masks, last_stats);
+}
+
+int Encoder::compress(const std::string &file_name_in, const std::string &file_name_out, const CoderControl &control)
+{
+    const Clock::time_point start = Clock::now();
+    CoderStats &stats = last_stats;
+    stats = CoderStats();
+    if (cached_output(options, true, file_name_in, file_name_out, start, stats))
+    {
+        return 0;
+    }
+    ResultCache::FileStamp input_stamp;
+    const bool caching = options.cache && ResultCache::stamp_of(file_name_in, input_stamp);
+    BitmapSource source(file_name_in, options.map_files);
+    ContentHasher input_hasher;
+    if (caching)
+    {
+        source.hash_into(input_hasher);
+    }
+    unsigned char header[sizeof(BarchHeader)];
+    write_barch_header(header, source.width(), source.height(), options);
+    end_stage(options, CoderStage::Parse, 0, start, 0, stats.parse_seconds);
+
+    OutputFile output_file(file_name_out);
+    std::ofstream &onp = output_file.stream;
+
+    // the band table is written as zeros and filled in once every band is written
+    const Clock::time_point header_start = Clock::now();
+    const unsigned int bands = (source.height() + barch_band_rows - 1) / barch_band_rows;
+    const size_t header_size = barch_header_size(source.height(), options.version);
+    onp.write((const char*)header, options.version == 1 ? 4 : sizeof(BarchHeader));
+    offsets.assign(bands + 1, 0);
+    if (options.version != 1)
+    {
+        onp.write((const char*)offsets.data(), offsets.size() * sizeof(uint64_t));
+    }
+    end_stage(options, CoderStage::Write, 0, header_start, header_size, stats.write_seconds);
+
+    // Windows of rows go through three stages: the reader thread loads window k + 1 while the
+    // pool encodes window k and the writer thread writes window k - 1. Inputs and outputs are
+    // double-buffered, window k uses slot k % 2 of both.
+    const unsigned int threads = pool->size();
+    const unsigned int per_window = window_bands(threads);
+    const unsigned int windows = (bands + per_window - 1) / per_window;
+    const RowFormat format = row_format(source.width(), options);
+    const size_t bound = band_bound(source.width(), barch_band_rows, format);
+    const size_t slot_size = std::min(per_window, bands) * bound;
+    const EncodeBandFunction encoder = band_encoder(source.format(), options.white_level, format.modes);
+    output.resize(2 * slot_size);
+    const unsigned char *rows[2] = {};
+    uint64_t sizes[2][max_window_bands];
+    auto first_row = [&](const unsigned int window) { return window * per_window * barch_band_rows; };
+    auto last_row = [&](const unsigned int window)
+    {
+        return std::min((window + 1) * per_window * barch_band_rows, source.height());
+    };
+    // the stages only touch their own stats fields, they are read once the stages are drained
+    auto read = [&](const unsigned int window)
+    {
+        const Clock::time_point read_start = Clock::now();
+        rows[window % 2] = source.load(first_row(window), last_row(window), input_windows[window % 2]);
+        const uint64_t bytes = static_cast<uint64_t>(last_row(window) - first_row(window))
+                             * static_cast<uint64_t>(std::abs(source.stride()));
+        stats.bytes_in += bytes;
+        end_stage(options, CoderStage::Load, window, read_start, bytes, stats.load_seconds);
+    };
+    auto write = [&](const unsigned int window)
+    {
+        const Clock::time_point write_start = Clock::now();
+        const unsigned int count = std::min(per_window, bands - window * per_window);
+        uint64_t bytes = 0;
+        for (unsigned int it = 0; it < count; ++it)
+        {
+            onp.write((const char*)output.data() + (window % 2) * slot_size + it * bound, sizes[window % 2][it]);
+            bytes += sizes[window % 2][it];
+        }
+        if (!onp)
+        {
+            throw std::runtime_error("Unable to write the output image file.");
+        }
+        end_stage(options, CoderStage::Write, window, write_start, bytes, stats.write_seconds);
+    };
+    if (!reader)
+    {
+        reader.reset(new StageThread());
+        writer.reset(new StageThread());
+    }
+    reader->start(read);
+    writer->start(write);
+    try
+    {
+        for (unsigned int window = 0; window < std::min(windows, 2u); ++window)
+        {
+            reader->post(window);
+        }
+        for (unsigned int window = 0; window < windows; ++window)
+        {
+            reader->wait();
+            if (writer->pending() == 2)
+            {// output slot window % 2 is still being written
+                writer->wait();
+            }
+            const unsigned int first_band = window * per_window;
+            const PixelRows window_rows = { rows[window % 2], source.stride(), source.width(),
+                                            static_cast<unsigned char>(options.white_level), encoder };
+            const Clock::time_point encode_start = Clock::now();
+            encode_window(window_rows, first_row(window), last_row(window), format, *pool, row_masks,
+                          output.data() + (window % 2) * slot_size, sizes[window % 2], stats.rows, control.cancel);
+            source.release(first_row(window), last_row(window));
+            for (unsigned int it = 0; it < std::min(per_window, bands - first_band); ++it)
+            {
+                offsets[first_band + it + 1] = offsets[first_band + it] + sizes[window % 2][it];
+            }
+            end_stage(options, CoderStage::Encode, window, encode_start,
+                      offsets[std::min(first_band + per_window, bands)] - offsets[first_band], stats.encode_seconds);
+            writer->post(window);
+            if (window + 2 < windows)
+            {
+                reader->post(window + 2);
+            }
+            if (control.progress)
+            {
+                control.progress(last_row(window), source.height());
+            }
+        }
+        while (writer->pending() > 0)
+        {
+            writer->wait();
+        }
+    }
+    catch (...)
+    {
+        reader->drain();
+        writer->drain();
+        throw;
+    }
+    const Clock::time_point table_start = Clock::now();
+    if (options.version != 1)
+    {
+        onp.seekp(sizeof(BarchHeader), onp.beg);
+        onp.write((const char*)offsets.data(), offsets.size() * sizeof(uint64_t));
+    }
+    output_file.keep();
+    uint64_t input_hash = 0;
+    if (caching && source.content_hash(input_hash))
+    {
+        options.cache->store(file_name_in, file_name_out, cache_key(options, true), input_stamp, input_hash);
+    }
+    end_stage(options, CoderStage::Write, 0, table_start, 0, stats.write_seconds);
+    stats.bytes_out = header_size + offsets[bands];
+    stats.total_seconds = seconds_since(start);
+    return 0;
+}
+
+int compress(const std::string &file_name_in, const std::string &file_name_out, const CoderOptions &options,
+             CoderStats *stats, const CoderControl &control)
+{
+    Encoder encoder(options);
+    const int result = encoder.compress(file_name_in, file_name_out, control);
+    if (stats)
+    {
+        *stats = encoder.stats();
+    }
+    return result;
+}
+
+size_t compress_to_buffer(const std::string &file_name_in, std::vector<unsigned char> &out, const CoderOptions &options)
+{
+    BitmapSource source(file_name_in, options.map_files);
+    std::vector<unsigned char> window;
+    const unsigned char *rows = source.height() > 0 ? source.load(0, source.height(), window) : nullptr;
+    // a top-down bitmap is walked backwards, its negative stride wraps around as an offset
+    const PixelSpan pixels = { rows, source.width(), source.height(), static_cast<size_t>(source.stride()),
+                               source.format() };
+    return compress_buffer(pixels, out, options);
+}
+
+size_t compress_bound(const unsigned int width, const unsigned int height, const CoderOptions &options)
+{
+    // the last window of bands is encoded at full band size before it is packed
+    const unsigned int threads = resolve_threads(options.threads);
+    const size_t rows = static_cast<size_t>(height) + window_bands(threads) * barch_band_rows;
+    return barch_header_size(height, options.version) + band_bound(width, 1, row_format(width, options)) * rows;
+}
+
+size_t compress_buffer(const PixelSpan &pixels, std::vector<unsigned char> &out, const CoderOptions &options)
+{
+    WorkerPool pool(resolve_threads(options.threads));
+    RowMasks masks;
+    CoderStats stats;
+    OutputArea area(out);
+    return compress_to(pixels, area, options, pool, masks, stats);
+}
+
+size_t compress_buffer(const PixelSpan &pixels, unsigned char *out, const size_t capacity, const CoderOptions &options)
+{
+    return Encoder(options).compress(pixels, out, capacity);
+}
+
+namespace
+{
+
+// Everything the decoder learns from one byte of the bitstream: the complete codes in it
+// expand to `pixels` pixels whose colors are the bits of `white`, and take `bits` bits.
+struct DecodeEntry
+{
+    uint32_t white;
+    uint8_t pixels;
+    uint8_t bits;
+};
+
+class DecodeTable
+{
+public:
+    DecodeTable()
+    {
+        for (unsigned int value = 0; value < 256; ++value)
+        {
+            DecodeEntry &entry = entries[value];
+            entry.white = 0;
+            entry.pixels = 0;
+            entry.bits = 0;
+            unsigned int length = 0;
+            Values code;
+            while (next_code(value >> entry.bits, 8 - entry.bits, code, length))
+            {
+                if (code == Values::White || code == Values::White4)
+                {
+                    entry.white |= (code == Values::White4 ? 0xfu : 0x1u) << entry.pixels;
+                }
+                entry.pixels += (code == Values::White4 || code == Values::Black4) ? 4 : 1;
+                entry.bits += length;
+            }
+        }
+        for (unsigned int nibble = 0; nibble < 16; ++nibble)
+        {
+            unsigned char bytes[4];
+            for (unsigned int it = 0; it < 4; ++it)
+            {
+                bytes[it] = (nibble >> it) & 1 ? 0xff : 0x00;
+            }
+            std::memcpy(&groups[nibble], bytes, 4);
+        }
+    }
+
+    // Reads one prefix code from the low `available` bits, false if they hold no complete code.
+    static bool next_code(const uint64_t bits, const unsigned int available, Values &code, unsigned int &length)
+    {
+        if (available < 1)
+        {
+            return false;
+        }
+        if (!(bits & 1))
+        {
+            code = Values::White4;
+            length = 1;
+            return true;
+        }
+        if (available < 2)
+        {
+            return false;
+        }
+        if (!(bits & 2))
+        {
+            code = Values::Black4;
+            length = 2;
+            return true;
+        }
+        if (available < 3)
+        {
+            return false;
+        }
+        code = (bits & 4) ? Values::Black : Values::White;
+        length = 3;
+        return true;
+    }
+
+    DecodeEntry entries[256];
+    uint32_t groups[16]; // four 0x00/0xff pixels for every 4-bit slice of a white mask
+};
+
+const DecodeTable &decode_table()
+{
+    static const DecodeTable table;
+    return table;
+}
+
+// 64-bit window over the row bitstream, least significant bit first. The row is `size`
+// bytes, but the bytes after it up to `end`, the rows that follow in the band, serve as a
+// guard margin: while 8 bytes are left before `end` whole words are loaded and the bytes past
+// the row masked off, so only the last bytes of a band are read one at a time.
+class BitReader
+{
+public:
+    BitReader(const unsigned char *data, const unsigned int size, const unsigned char *end)
+        : data(data)
+        , size(size)
+        , readable(static_cast<size_t>(end - data))
+        , byte_it(0)
+        , bits(0)
+        , count(0)
+    {}
+
+    void refill()
+    {
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        if (byte_it + 8 <= readable)
+        {// the bytes past the taken ones land above `count` and are OR-ed in again later
+            uint64_t word;
+            std::memcpy(&word, data + byte_it, 8);
+            const unsigned int left = size - byte_it;
+            if (left < 8)
+            {
+                word &= ~(~uint64_t(0) << (8 * left));
+            }
+            bits |= word << count;
+            const unsigned int take = std::min((63 - count) >> 3, left);
+            byte_it += take;
+            count += take * 8;
+            return;
+        }
+#endif
+        while (count <= 56 && byte_it < size)
+        {
+            bits |= static_cast<uint64_t>(data[byte_it++]) << count;
+            count += 8;
+        }
+    }
+
+    void skip(const unsigned int length)
+    {
+        bits >>= length;
+        count -= length;
+    }
+
+    uint64_t peek() const { return bits; }
+    unsigned int available() const { return count; }
+    unsigned int unread_bytes() const { return size - byte_it + count / 8; }
+
+private:
+    const unsigned char *data;
+    unsigned int size;
+    size_t readable;
+    unsigned int byte_it;
+    uint64_t bits;
+    unsigned int count;
+};
+
+// Decodes one non-empty row into out[0, width). While at least 32 pixels are left every byte
+// of codes is expanded by a single table lookup into 4-pixel stores; the rest of the row goes
+// code by code so nothing is written past the width. Pixels missing from a short row are white.
+// Returns false when the row data doesn't match the width. The data may be read up to `end`,
+// at least the end of the row, see BitReader.
+bool decode_row(const unsigned char *row_data, const unsigned int row_size, const unsigned char *end,
+                unsigned char *out, const unsigned int width)
+{
+    const DecodeTable &table = decode_table();
+    BitReader reader(row_data, row_size, end);
+    unsigned int out_it = 0;
+    while (out_it + 32 <= width)
+    {
+        reader.refill();
+        if (reader.available() < 8)
+        {
+            break;
+        }
+        const DecodeEntry &entry = table.entries[reader.peek() & 0xff];
+        for (unsigned int it = 0; it < entry.pixels; it += 4)
+        {
+            std::memcpy(out + out_it + it, &table.groups[(entry.white >> it) & 0xf], 4);
+        }
+        out_it += entry.pixels;
+        reader.skip(entry.bits);
+    }
+    Values code;
+    unsigned int length = 0;
+    while (out_it < width)
+    {
+        reader.refill();
+        if (!DecodeTable::next_code(reader.peek(), reader.available(), code, length))
+        {
+            break;
+        }
+        reader.skip(length);
+        const unsigned int pixels = (code == Values::White4 || code == Values::Black4) ? 4 : 1;
+        const unsigned int fit = pixels < width - out_it ? pixels : width - out_it;
+        const unsigned char color = (code == Values::White || code == Values::White4) ? 0xff : 0x00;
+        std::memset(out + out_it, color, fit);
+        out_it += fit;
+    }
+    const bool complete = out_it == width && reader.unread_bytes() == 0;
+    std::memset(out + out_it, 0xff, width - out_it);
+    return complete;
+}
+
+// Where the rows of a .barch image are. A v1 image is one band holding every row.
+struct BarchLayout
+{
+    BarchHeader header;
+    const unsigned char *table; // band_count + 1 offsets of the bands from `rows`, nullptr for v1
+    uint64_t rows_size;
+    const unsigned char *rows;
+
+    uint64_t offset(const unsigned int band) const
+    {
+        if (!table)
+        {
+            return band == 0 ? 0 : rows_size;
+        }
+        uint64_t value = 0;
+        std::memcpy(&value, table + band * sizeof(uint64_t), sizeof(uint64_t));
+        return value;
+    }
+};
+
+// v1: 16-bit width and height, then the rows
+BarchLayout read_v1_layout(const unsigned char *bytes, const size_t size)
+{
+    BarchLayout layout;
+    uint16_t dimensions[2];
+    std::memcpy(dimensions, bytes, sizeof(dimensions));
+    layout.header.version = 1;
+    layout.header.width = dimensions[0];
+    layout.header.height = dimensions[1];
+    layout.header.band_rows = std::max(1u, layout.header.height);
+    layout.header.band_count = 1;
+    layout.table = nullptr;
+    layout.rows = bytes + sizeof(dimensions);
+    layout.rows_size = size - sizeof(dimensions);
+    if (layout.rows_size / row_prefix_bound(false) < layout.header.height)
+    {
+        throw std::runtime_error("Error! Truncated .barch row data.");
+    }
+    return layout;
+}
+
+// Whether `bytes` hold a v1 image whose row size prefixes take up the rest of them exactly,
+// as they do in every v1 file compress() writes.
+bool is_exact_v1(const unsigned char *bytes, const size_t size)
+{
+    uint16_t dimensions[2];
+    std::memcpy(dimensions, bytes, sizeof(dimensions));
+    size_t it = sizeof(dimensions);
+    for (unsigned int row = 0; row < dimensions[1]; ++row)
+    {
+        uint16_t row_size = 0;
+        if (size - it < sizeof(row_size))
+        {
+            return false;
+        }
+        std::memcpy(&row_size, bytes + it, sizeof(row_size));
+        it += sizeof(row_size);
+        if (size - it < row_size)
+        {
+            return false;
+        }
+        it += row_size;
+    }
+    return it == size;
+}
+
+BarchLayout read_v2_layout(const unsigned char *bytes, const size_t size)
+{
+    BarchLayout layout;
+    const BarchHeader &header = layout.header;
+    if (size < sizeof(BarchHeader))
+    {
+        throw std::runtime_error("Error! Unrecognized .barch header.");
+    }
+    std::memcpy(&layout.header, bytes, sizeof(BarchHeader));
+    if (header.version != 2 || header.band_rows == 0 || (header.flags & ~barch_known_flags) != 0
+            || header.band_count != (static_cast<uint64_t>(header.height) + header.band_rows - 1) / header.band_rows
+            || static_cast<uint64_t>(header.band_count) * header.band_rows > 0xffffffffu)
+    {
+        throw std::runtime_error("Error! Unrecognized .barch header.");
+    }
+    const size_t table_size = (static_cast<size_t>(header.band_count) + 1) * sizeof(uint64_t);
+    if (size - sizeof(BarchHeader) < table_size)
+    {
+        throw std::runtime_error("Error! Broken .barch band table.");
+    }
+    layout.table = bytes + sizeof(BarchHeader);
+    layout.rows = layout.table + table_size;
+    layout.rows_size = size - sizeof(BarchHeader) - table_size;
+    bool sorted = layout.offset(0) == 0;
+    for (unsigned int band = 0; sorted && band < header.band_count; ++band)
+    {
+        sorted = layout.offset(band) <= layout.offset(band + 1);
+    }
+    if (!sorted || layout.offset(header.band_count) > layout.rows_size)
+    {
+        throw std::runtime_error("Error! Broken .barch band table.");
+    }
+    // every row takes its size prefix at least, so a band too short for its rows is refused
+    // here rather than after the pixels are allocated
+    const unsigned int min_prefix = (header.flags & barch_flag_wide_rows) ? 1 : row_prefix_bound(false);
+    for (unsigned int band = 0; band < header.band_count; ++band)
+    {
+        const unsigned int rows = std::min(header.band_rows, header.height - band * header.band_rows);
+        if ((layout.offset(band + 1) - layout.offset(band)) / min_prefix < rows)
+        {
+            throw std::runtime_error("Error! Truncated .barch row data.");
+        }
+    }
+    return layout;
+}
+
+BarchLayout read_barch_layout(const unsigned char *bytes, const size_t size)
+{
+    uint32_t magic = 0;
+    if (size < sizeof(magic))
+    {
+        throw std::runtime_error("Error! The file is too short for a .barch image.");
+    }
+    std::memcpy(&magic, bytes, sizeof(magic));
+    if (magic != barch_magic)
+    {
+        return read_v1_layout(bytes, size);
+    }
+    // A v1 image 21058 pixels wide and 18499 high starts with the bytes of the v2 magic as
+    // well. Its file is read as v2 if it holds a valid v2 header, and as v1 otherwise when its
+    // rows fill it exactly; a broken v2 file reports the v2 error.
+    try
+    {
+        return read_v2_layout(bytes, size);
+    }
+    catch (const std::runtime_error &)
+    {
+        if (is_exact_v1(bytes, size))
+        {
+            return read_v1_layout(bytes, size);
+        }
+        throw;
+    }
+}
+
+// read_barch_layout() for the decoders, which also hold the image to CoderOptions::max_pixels
+// before allocating anything for it. Row scratch is allocated even without rows, so an image
+// counts one row at least.
+BarchLayout read_decoder_layout(const unsigned char *bytes, const size_t size, const CoderOptions &options)
+{
+    const BarchLayout layout = read_barch_layout(bytes, size);
+    if (options.max_pixels != 0
+        && static_cast<uint64_t>(layout.header.width) * std::max(layout.header.height, 1u) > options.max_pixels)
+    {
+        throw std::runtime_error("Error! The image has more pixels than the decoder is allowed.");
+    }
+    return layout;
+}
+
+std::shared_ptr<MappedFile> open_barch(const std::string &file_name, const bool allow_mapping)
+{
+    try
+    {
+        return std::make_shared<MappedFile>(file_name, allow_mapping);
+    }
+    catch (const std::exception&)
+    {
+        throw std::runtime_error("Unable to open the input archive file.");
+    }
+}
+
+// Reads a varint of at most 5 bytes at data + it and moves `it` past it. Returns false when
+// the data ends first or the value doesn't fit 32 bits.
+bool read_varint(const unsigned char *data, const size_t size, size_t &it, uint32_t &result)
+{
+    uint64_t value = 0;
+    for (unsigned int shift = 0; shift < 35 && it < size; shift += 7)
+    {
+        const unsigned char byte = data[it++];
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            result = static_cast<uint32_t>(value);
+            return value <= 0xffffffff;
+        }
+    }
+    return false;
+}
+
+// Reads the size prefix of a row at data + it and moves `it` past it.
+bool read_row_size(const unsigned char *data, const size_t size, size_t &it, const bool wide, uint32_t &row_size)
+{
+    if (wide)
+    {
+        return read_varint(data, size, it, row_size);
+    }
+    uint16_t size16 = 0;
+    if (size - it < sizeof(size16))
+    {
+        return false;
+    }
+    std::memcpy(&size16, data + it, sizeof(size16));
+    it += sizeof(size16);
+    row_size = size16;
+    return true;
+}
+
+// Decodes a RowMode::Runs row: every run is a single memset.
+bool decode_runs(const unsigned char *row_data, const size_t row_size, unsigned char *out, const unsigned int width)
+{
+    size_t it = 0;
+    unsigned int pos = 0;
+    bool white = true;
+    uint32_t length = 0;
+    while (it < row_size)
+    {
+        if (!read_varint(row_data, row_size, it, length) || length > width - pos)
+        {
+            std::memset(out + pos, 0xff, width - pos);
+            return false;
+        }
+        std::memset(out + pos, white ? 0xff : 0x00, length);
+        pos += length;
+        white = !white;
+    }
+    std::memset(out + pos, 0xff, width - pos);
+    return true;
+}
+
+// Decodes a RowMode::Delta row over a copy of the previous row, which may be `out` itself.
+bool decode_delta(const unsigned char *row_data, const size_t row_size, const unsigned char *previous,
+                  unsigned char *out, const unsigned int width)
+{
+    if (previous != out)
+    {
+        std::memcpy(out, previous, width);
+    }
+    size_t it = 0;
+    unsigned int pos = 0;
+    bool flip = false;
+    uint32_t length = 0;
+    while (it < row_size)
+    {
+        if (!read_varint(row_data, row_size, it, length) || length > width - pos)
+        {
+            return false;
+        }
+        if (flip)
+        {
+            for (unsigned int x = pos; x < pos + length; ++x)
+            {
+                out[x] ^= 0xff;
+            }
+        }
+        pos += length;
+        flip = !flip;
+    }
+    return true;
+}
+
+// Decodes one non-empty row of an image with row modes, readable up to `end`.
+bool decode_row_mode(const unsigned char *row_data, const unsigned int row_size, const unsigned char *end,
+                     const unsigned char *previous, unsigned char *out, const unsigned int width)
+{
+    switch (static_cast<RowMode>(row_data[0]))
+    {
+    case RowMode::Codes : return decode_row(row_data + 1, row_size - 1, end, out, width);
+    case RowMode::Runs : return decode_runs(row_data + 1, row_size - 1, out, width);
+    case RowMode::Delta :
+        if (previous)
+        {
+            return decode_delta(row_data + 1, row_size - 1, previous, out, width);
+        }
+        break;
+    }
+    std::memset(out, 0xff, width);
+    return false;
+}
+
+// Packs a row of 0x00/0xff pixels eight to a byte, most significant bit first, a set bit being
+// white (black when inverted). The bits past the width are zero.
+void pack_row(const unsigned char *pixels, const unsigned int width, unsigned char *out, const bool inverted)
+{
+    const unsigned char flip = inverted ? 0xff : 0x00;
+    unsigned int x = 0;
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; x + 8 <= width; x += 8)
+    {// every byte keeps its own bit, the multiply gathers them into the top byte without carries
+        uint64_t word;
+        std::memcpy(&word, pixels + x, 8);
+        word &= 0x0102040810204080ull;
+        *out++ = static_cast<unsigned char>((word * 0x0101010101010101ull) >> 56) ^ flip;
+    }
+#endif
+    for (; x < width; x += 8)
+    {
+        unsigned char byte = 0;
+        const unsigned int count = std::min(8u, width - x);
+        for (unsigned int bit = 0; bit < count; ++bit)
+        {
+            byte |= (pixels[x + bit] & 0x80) >> bit;
+        }
+        *out++ = byte ^ (flip & static_cast<unsigned char>(0xff00 >> count));
+    }
+}
+
+// Decodes `rows` size-prefixed rows into out, `stride` bytes apart, after skipping the first
+// `skip_rows` rows of the data. Returns the number of bytes consumed.
+// Rows coded against the row before need the skipped rows too, those are decoded into the
+// first output row, which is overwritten later.
+// Mono1 and Mono1Inverted rows are decoded into `scratch`, two rows of width bytes, and packed
+// from there, so the previous row is still at hand for delta rows.
+// The rows past the skipped ones are added to `counts`.
+size_t decode_rows(const unsigned char *data, const size_t size, const unsigned int skip_rows, const unsigned int rows,
+                   unsigned char *out, const size_t stride, const unsigned int width, const RowFormat &format,
+                   const PixelFormat pixel_format, unsigned char *scratch, RowTypeCounts &counts)
+{
+    const bool packed = pixel_format != PixelFormat::Gray8;
+    size_t it = 0;
+    const unsigned char *previous = nullptr;
+    for (unsigned int row = 0; row < skip_rows + rows; ++row)
+    {
+        uint32_t row_size = 0;
+        if (!read_row_size(data, size, it, format.wide, row_size))
+        {
+            throw std::runtime_error("Error! Truncated .barch row data.");
+        }
+        if (size - it < row_size)
+        {
+            throw std::runtime_error("Error! Truncated .barch row data.");
+        }
+        if (row >= skip_rows || format.modes)
+        {
+            unsigned char *const out_row = packed ? scratch + (row & 1) * static_cast<size_t>(width)
+                                                  : out + (row < skip_rows ? 0 : (row - skip_rows) * stride);
+            bool complete = true;
+            RowMode mode = RowMode::Codes;
+            if (row_size == 0)
+            {// empty row
+                std::memset(out_row, 0xff, width);
+            }
+            else if (format.modes)
+            {
+                mode = static_cast<RowMode>(data[it]);
+                complete = decode_row_mode(data + it, row_size, data + size, previous, out_row, width);
+            }
+            else
+            {
+                complete = decode_row(data + it, row_size, data + size, out_row, width);
+            }
+            if (row >= skip_rows)
+            {
+                ++(!complete ? counts.bad : row_size == 0 ? counts.empty : mode == RowMode::Runs ? counts.runs
+                   : mode == RowMode::Delta ? counts.delta : counts.codes);
+            }
+            previous = out_row;
+            if (packed && row >= skip_rows)
+            {
+                pack_row(out_row, width, out + (row - skip_rows) * stride, pixel_format == PixelFormat::Mono1Inverted);
+            }
+        }
+        it += row_size;
+    }
+    return it;
+}
+
+// Decodes rows [first_row, first_row + row_count) into out, `stride` bytes apart, and zeroes
+// the bytes between the row and the stride. A v1 image can only be walked row after row,
+// the bands of a v2 image are found through the band table and decoded side by side.
+// Rows are Gray8, Mono1 or Mono1Inverted; the packed ones need two rows of width bytes of
+// scratch for every worker of the pool. The decoded rows are added to `counts`, `cancel` is
+// checked before every band.
+void decode_image(const BarchLayout &layout, const unsigned int first_row, const unsigned int row_count,
+                  unsigned char *out, const size_t stride, WorkerPool &pool, RowTypeCounts &counts,
+                  const PixelFormat pixel_format = PixelFormat::Gray8, unsigned char *scratch = nullptr,
+                  const std::atomic<bool> *cancel = nullptr)
+{
+    if (row_count == 0 || layout.header.width == 0)
+    {// a zero-width image has no pixels, and its output may not even be allocated
+        return;
+    }
+    const unsigned int width = layout.header.width;
+    const unsigned int band_rows = layout.header.band_rows;
+    const unsigned int first_band = first_row / band_rows;
+    const unsigned int last_band = (first_row + row_count - 1) / band_rows + 1;
+    const size_t out_row_bytes = row_bytes(width, pixel_format);
+    std::mutex counts_mutex;
+    auto job = [&](const unsigned int it, const unsigned int worker)
+    {
+        check_cancel(cancel);
+        RowTypeCounts band_counts;
+        const unsigned int band = first_band + it;
+        const unsigned int band_first_row = std::max(band * band_rows, first_row);
+        const unsigned int band_last_row = std::min((band + 1) * band_rows, first_row + row_count);
+        unsigned char *const band_out = out + static_cast<size_t>(band_first_row - first_row) * stride;
+        decode_rows(layout.rows + layout.offset(band), layout.offset(band + 1) - layout.offset(band),
+                    band_first_row - band * band_rows, band_last_row - band_first_row, band_out, stride, width,
+                    row_format(layout.header.flags), pixel_format,
+                    scratch ? scratch + worker * 2 * static_cast<size_t>(width) : nullptr, band_counts);
+        for (unsigned int row = 0; row < band_last_row - band_first_row && stride > out_row_bytes; ++row)
+        {
+            std::memset(band_out + row * stride + out_row_bytes, 0, stride - out_row_bytes);
+        }
+        std::lock_guard<std::mutex> lock(counts_mutex);
+        counts += band_counts;
+    };
+    if (layout.table)
+    {
+        pool.run(last_band - first_band, job);
+    }
+    else
+    {
+        job(0, 0);
+    }
+}
+
+// Adds `count` white pixels from `pos` on to the sums of the blocks, 2^shift pixels wide,
+// that they fall into.
+void add_white(uint16_t *sums, unsigned int pos, unsigned int count, const unsigned int shift)
+{
+    const unsigned int block_width = 1u << shift;
+    const unsigned int head = std::min(count, (block_width - pos % block_width) % block_width);
+    if (head > 0)
+    {
+        sums[pos >> shift] += head;
+        pos += head;
+        count -= head;
+    }
+    // whole blocks in a loop of its own, which the compiler vectorizes
+    uint16_t *const blocks = sums + (pos >> shift);
+    const unsigned int whole = count >> shift;
+    for (unsigned int block = 0; block < whole; ++block)
+    {
+        blocks[block] += block_width;
+    }
+    if (count % block_width > 0)
+    {
+        blocks[whole] += count % block_width;
+    }
+}
+
+// Takes the colors of a row one bit per pixel, a set bit being white, and adds them to the
+// block sums 64 pixels at a time: the bits are counted within every block of the word at once,
+// by adding neighbouring bit fields until the fields are as wide as the blocks.
+class BlockFolder
+{
+public:
+    BlockFolder(uint16_t *sums, const unsigned int shift)
+        : sums(sums)
+        , shift(shift)
+        , word(0)
+        , fill(0)
+    {}
+
+    // Adds `count` pixels, at most 32, whose colors are the low bits of `white`.
+    void add(const uint64_t white, const unsigned int count)
+    {
+        word |= white << fill;
+        fill += count;
+        if (fill >= 64)
+        {
+            fold(word, 64);
+            fill -= 64;
+            word = fill > 0 ? white >> (count - fill) : 0;
+        }
+    }
+
+    // Adds `count` white pixels.
+    void add_white(unsigned int count)
+    {
+        for (; count >= 32; count -= 32)
+        {
+            add(0xffffffffu, 32);
+        }
+        add((uint64_t(1) << count) - 1, count);
+    }
+
+    // Adds the pixels still held.
+    void finish()
+    {
+        if (fill > 0)
+        {
+            fold(word, fill);
+        }
+    }
+
+private:
+    void fold(uint64_t bits, const unsigned int count)
+    {
+        if (shift >= 1)
+        {
+            bits = (bits & 0x5555555555555555ull) + ((bits >> 1) & 0x5555555555555555ull);
+        }
+        if (shift >= 2)
+        {
+            bits = (bits & 0x3333333333333333ull) + ((bits >> 2) & 0x3333333333333333ull);
+        }
+        if (shift >= 3)
+        {
+            bits = (bits & 0x0f0f0f0f0f0f0f0full) + ((bits >> 4) & 0x0f0f0f0f0f0f0f0full);
+        }
+        const unsigned int blocks = (count + (1u << shift) - 1) >> shift;
+        const uint64_t field = (uint64_t(1) << (1u << shift)) - 1;
+        for (unsigned int block = 0; block < blocks; ++block)
+        {
+            sums[block] += static_cast<uint16_t>((bits >> (block << shift)) & field);
+        }
+        sums += 64 >> shift;
+    }
+
+    uint16_t *sums;
+    unsigned int shift;
+    uint64_t word;
+    unsigned int fill;
+};
+
+// Adds a row of 0x00/0xff pixels to the block sums.
+void fold_pixels(const unsigned char *row, const unsigned int width, uint16_t *sums, const unsigned int shift)
+{
+    BlockFolder folder(sums, shift);
+    unsigned int x = 0;
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; x + 8 <= width; x += 8)
+    {// the low bit of byte i lands on bit i of the top byte, as in pack_row()
+        uint64_t bytes;
+        std::memcpy(&bytes, row + x, 8);
+        folder.add(((bytes & 0x0101010101010101ull) * 0x0102040810204080ull) >> 56, 8);
+    }
+#endif
+    for (; x < width; ++x)
+    {
+        folder.add(row[x] & 1, 1);
+    }
+    folder.finish();
+}
+
+// decode_row() into block sums: the white mask of every table entry goes to the folder as it
+// is, the pixels are never written out. Pixels missing from a short row are white.
+bool fold_codes(const unsigned char *row_data, const unsigned int row_size, const unsigned char *end, uint16_t *sums,
+                const unsigned int width, const unsigned int shift)
+{
+    const DecodeTable &table = decode_table();
+    BitReader reader(row_data, row_size, end);
+    BlockFolder folder(sums, shift);
+    unsigned int pos = 0;
+    while (pos + 32 <= width)
+    {
+        reader.refill();
+        if (reader.available() < 8)
+        {
+            break;
+        }
+        const DecodeEntry &entry = table.entries[reader.peek() & 0xff];
+        folder.add(entry.white, entry.pixels);
+        pos += entry.pixels;
+        reader.skip(entry.bits);
+    }
+    Values code;
+    unsigned int length = 0;
+    while (pos < width)
+    {
+        reader.refill();
+        if (!DecodeTable::next_code(reader.peek(), reader.available(), code, length))
+        {
+            break;
+        }
+        reader.skip(length);
+        const unsigned int pixels = (code == Values::White4 || code == Values::Black4) ? 4 : 1;
+        const unsigned int fit = pixels < width - pos ? pixels : width - pos;
+        folder.add(code == Values::White || code == Values::White4 ? (1u << fit) - 1 : 0, fit);
+        pos += fit;
+    }
+    const bool complete = pos == width && reader.unread_bytes() == 0;
+    folder.add_white(width - pos);
+    folder.finish();
+    return complete;
+}
+
+// decode_runs() into block sums, a run costs one addition per block it touches.
+bool fold_runs(const unsigned char *row_data, const size_t row_size, uint16_t *sums, const unsigned int width,
+               const unsigned int shift)
+{
+    size_t it = 0;
+    unsigned int pos = 0;
+    bool white = true;
+    uint32_t length = 0;
+    while (it < row_size)
+    {
+        if (!read_varint(row_data, row_size, it, length) || length > width - pos)
+        {
+            add_white(sums, pos, width - pos, shift);
+            return false;
+        }
+        if (white)
+        {
+            add_white(sums, pos, length, shift);
+        }
+        pos += length;
+        white = !white;
+    }
+    add_white(sums, pos, width - pos, shift);
+    return true;
+}
+
+// How a band is shrunk into a preview.
+struct PreviewScale
+{
+    unsigned int width;      // of the image
+    unsigned int out_width;  // of the preview
+    unsigned int shift_x;    // log2 of the scales
+    unsigned int shift_y;
+};
+
+// Writes one row of the preview from the block sums of one image row.
+void emit_blocks(const uint16_t *sums, const PreviewScale &scale, unsigned char *out)
+{
+    const unsigned int block_width = 1u << scale.shift_x;
+    for (unsigned int block = 0; block < scale.out_width; ++block)
+    {
+        const unsigned int pixels = std::min(block_width, scale.width - block * block_width);
+        out[block] = static_cast<unsigned char>((sums[block] * 255u + pixels / 2) / pixels);
+    }
+}
+
+// decode_rows() for previews: of rows [skip_rows, skip_rows + rows) of a band the first of
+// every block row is folded into a preview row, the rows are `stride` bytes apart and written
+// from `out` on. `phase` is the place of the first row in its block, so a block may go on from
+// one band to the next. Codes and run rows go straight into the block sums, the other rows
+// are stepped over by their size prefix. A row is only expanded to pixels, in `scratch` (two
+// rows of width bytes), when it is a delta row or the row after it is one.
+void fold_rows(const unsigned char *data, const size_t size, const unsigned int skip_rows, const unsigned int rows,
+               unsigned char *&out, const size_t stride, unsigned int &phase, const RowFormat &format,
+               const PreviewScale &scale, unsigned char *scratch, uint16_t *sums, RowTypeCounts &counts)
+{
+    const unsigned int width = scale.width;
+    const unsigned int end_row = skip_rows + rows;
+    const unsigned int block_mask = (1u << scale.shift_y) - 1;
+    size_t it = 0;
+    const unsigned char *previous = nullptr;
+    for (unsigned int row = 0; row < end_row; ++row)
+    {
+        uint32_t row_size = 0;
+        if (!read_row_size(data, size, it, format.wide, row_size) || size - it < row_size)
+        {
+            throw std::runtime_error("Error! Truncated .barch row data.");
+        }
+        const unsigned char *const row_data = data + it;
+        it += row_size;
+        bool next_delta = false;
+        if (format.modes && row + 1 < end_row)
+        {
+            size_t next = it;
+            uint32_t next_size = 0;
+            next_delta = read_row_size(data, size, next, format.wide, next_size) && next_size > 0 && next < size
+                      && static_cast<RowMode>(data[next]) == RowMode::Delta;
+        }
+        const RowMode mode = format.modes && row_size > 0 ? static_cast<RowMode>(row_data[0]) : RowMode::Codes;
+        const bool wanted = row >= skip_rows;
+        const bool sampled = wanted && phase == 0;
+        if (wanted)
+        {
+            phase = (phase + 1) & block_mask;
+        }
+        if (!sampled && !next_delta)
+        {
+            previous = nullptr;
+            if (wanted)
+            {
+                ++(row_size == 0 ? counts.empty : mode == RowMode::Runs ? counts.runs
+                   : mode == RowMode::Delta ? counts.delta : counts.codes);
+            }
+            continue;
+        }
+        if (sampled)
+        {
+            std::memset(sums, 0, scale.out_width * sizeof(uint16_t));
+        }
+
+        const unsigned int codes_offset = format.modes ? 1 : 0;
+        bool complete = true;
+        if (next_delta || (row_size > 0 && mode == RowMode::Delta))
+        {
+            unsigned char *const expanded = scratch + (row & 1) * static_cast<size_t>(width);
+            if (row_size == 0)
+            {
+                std::memset(expanded, 0xff, width);
+            }
+            else
+            {
+                complete = decode_row_mode(row_data, row_size, data + size, previous, expanded, width);
+            }
+            previous = expanded;
+            if (sampled)
+            {
+                fold_pixels(expanded, width, sums, scale.shift_x);
+            }
+        }
+        else
+        {
+            previous = nullptr;
+            if (row_size == 0)
+            {
+                add_white(sums, 0, width, scale.shift_x);
+            }
+            else if (mode == RowMode::Runs)
+            {
+                complete = fold_runs(row_data + 1, row_size - 1, sums, width, scale.shift_x);
+            }
+            else
+            {
+                complete = fold_codes(row_data + codes_offset, row_size - codes_offset, data + size, sums, width,
+                                      scale.shift_x);
+            }
+        }
+        if (!wanted)
+        {
+            continue;
+        }
+        ++(!complete ? counts.bad : row_size == 0 ? counts.empty : mode == RowMode::Runs ? counts.runs
+           : mode == RowMode::Delta ? counts.delta : counts.codes);
+        if (sampled)
+        {
+            emit_blocks(sums, scale, out);
+            out += stride;
+        }
+    }
+}
+
+// decode_image() for previews. The region is already widened to whole blocks, so with
+// bands a multiple of the block height every band starts a block and is folded on its own;
+// other band heights are folded one band after the other. Every worker needs out_width block
+// sums and two rows of width bytes of scratch.
+void decode_preview(const BarchLayout &layout, const unsigned int first_row, const unsigned int row_count,
+                    const PreviewScale &scale, unsigned char *out, WorkerPool &pool, unsigned char *scratch,
+                    uint16_t *sums, RowTypeCounts &counts)
+{
+    if (row_count == 0 || scale.width == 0)
+    {
+        return;
+    }
+    const unsigned int band_rows = layout.header.band_rows;
+    const unsigned int first_band = first_row / band_rows;
+    const unsigned int last_band = (first_row + row_count - 1) / band_rows + 1;
+    const RowFormat format = row_format(layout.header.flags);
+    auto fold_band = [&](const unsigned int band, unsigned char *&band_out, unsigned int &phase,
+                         const unsigned int worker, RowTypeCounts &band_counts)
+    {
+        const unsigned int band_first_row = std::max(band * band_rows, first_row);
+        const unsigned int band_last_row = std::min((band + 1) * band_rows, first_row + row_count);
+        fold_rows(layout.rows + layout.offset(band), layout.offset(band + 1) - layout.offset(band),
+                  band_first_row - band * band_rows, band_last_row - band_first_row,
+                  band_out, scale.out_width, phase, format, scale,
+                  scratch + worker * 2 * static_cast<size_t>(scale.width),
+                  sums + worker * static_cast<size_t>(scale.out_width), band_counts);
+    };
+    if (!layout.table || band_rows % (1u << scale.shift_y) != 0)
+    {
+        unsigned int phase = 0;
+        for (unsigned int band = first_band; band < last_band; ++band)
+        {
+            fold_band(band, out, phase, 0, counts);
+        }
+        return;
+    }
+    std::mutex counts_mutex;
+    auto job = [&](const unsigned int it, const unsigned int worker)
+    {
+        RowTypeCounts band_counts;
+        const unsigned int band = first_band + it;
+        const unsigned int band_first_row = std::max(band * band_rows, first_row);
+        unsigned char *band_out = out + static_cast<size_t>((band_first_row - first_row) >> scale.shift_y)
+                                      * scale.out_width;
+        unsigned int phase = 0;
+        fold_band(band, band_out, phase, worker, band_counts);
+        std::lock_guard<std::mutex> lock(counts_mutex);
+        counts += band_counts;
+    };
+    pool.run(last_band - first_band, job);
+}
+
+// decode_image() for the calls without a file pipeline, the whole call is the decode stage.
+void decode_in_memory(const BarchLayout &layout, const unsigned int first_row, const unsigned int row_count,
+                      unsigned char *pixels, const size_t stride, const size_t archive_size, WorkerPool &pool,
+                      const CoderOptions &options, CoderStats &stats)
+{
+    const Clock::time_point start = Clock::now();
+    stats = CoderStats();
+    decode_image(layout, first_row, row_count, pixels, stride, pool, stats.rows);
+    stats.bytes_in = archive_size;
+    stats.bytes_out = static_cast<uint64_t>(row_count) * layout.header.width;
+    end_stage(options, CoderStage::Decode, 0, start, stats.bytes_out, stats.decode_seconds);
+    stats.total_seconds = stats.decode_seconds;
+}
+
+BarchInfo barch_info(const BarchLayout &layout)
+{
+    BarchInfo info;
+    info.width = layout.header.width;
+    info.height = layout.header.height;
+    info.version = layout.header.version;
+    return info;
+}
+
+} // namespace
+
+Decoder::Decoder(const CoderOptions &options)
+    : options(options)
+    , pool(new WorkerPool(resolve_threads(options.threads)))
+{}
+
+Decoder::~Decoder() = default;
+
+int Decoder::decompress(const std::string &file_name_in, const std::string &file_name_out, const CoderControl &control)
+{
+    const Clock::time_point start = Clock::now();
+    last_stats = CoderStats();
+    if (cached_output(options, false, file_name_in, file_name_out, start, last_stats))
+    {
+        return 0;
+    }
+    ResultCache::FileStamp input_stamp;
+    const bool caching = options.cache && ResultCache::stamp_of(file_name_in, input_stamp);
+    const auto file = open_barch(file_name_in, options.map_files);
+    ContentHasher input_hasher;
+    write_image(file.get(), file->data(), file->size(), file_name_out, control, start,
+                caching ? &input_hasher : nullptr);
+    if (caching && input_hasher.size() == file->size())
+    {
+        options.cache->store(file_name_in, file_name_out, cache_key(options, false), input_stamp, input_hasher.value());
+    }
+    last_stats.total_seconds = seconds_since(start);
+    return 0;
+}
+
+int Decoder::decompress(const unsigned char *data, const size_t size, const std::string &file_name_out,
+                        const CoderControl &control)
+{
+    const Clock::time_point start = Clock::now();
+    last_stats = CoderStats();
+    write_image(nullptr, data, size, file_name_out, control, start, nullptr);
+    last_stats.total_seconds = seconds_since(start);
+    return 0;
+}
+
+void Decoder::write_image(const MappedFile *file, const unsigned char *data, const size_t size,
+                          const std::string &file_name_out, const CoderControl &control, const Clock::time_point start,
+                          ContentHasher *hasher)
+{
+    CoderStats &stats = last_stats;
+    const BarchLayout layout = read_decoder_layout(data, size, options);
+    // the archive is hashed up to `hashed` as the reader brings its bands in, bottom band first
+    const unsigned char *hashed = data;
+    auto hash_to = [&](const unsigned char *end)
+    {
+        if (hasher && end > hashed)
+        {
+            hasher->update(hashed, end - hashed);
+            hashed = end;
+        }
+    };
+    end_stage(options, CoderStage::Parse, 0, start, 0, stats.parse_seconds);
+    const unsigned int out_width = layout.header.width;
+    const unsigned int out_height = layout.header.height;
+    const OutputFormat output_format = options.output_format;
+    const PixelFormat pixel_format = output_format == OutputFormat::Bmp8 ? PixelFormat::Gray8
+                                   : output_format == OutputFormat::Bmp1 ? PixelFormat::Mono1
+                                                                         : PixelFormat::Mono1Inverted;
+    // BMP rows are padded to 4 bytes, PBM rows only to a whole byte
+    const size_t packed_width = row_bytes(out_width, pixel_format);
+    const size_t alligned_width = output_format == OutputFormat::Pbm ? packed_width : (packed_width + 3) & ~size_t(3);
+    const size_t data_size = alligned_width * out_height;
+    const uint32_t palette_size = output_format == OutputFormat::Bmp1 ? 2 * sizeof(uint32_t) : sizeof(BMPColorHeader);
+    if (output_format != OutputFormat::Pbm
+        && data_size > 0xffffffffu - sizeof(BMPFileHeader) - sizeof(BMPInfoHeader) - palette_size)
+    {
+        throw std::runtime_error("Error! The image is too large for a BMP file.");
+    }
+
+    OutputFile output_file(file_name_out);
+    std::ofstream &onp = output_file.stream;
+    const Clock::time_point header_start = Clock::now();
+    if (output_format == OutputFormat::Pbm)
+    {
+        onp << "P4\n" << out_width << " " << out_height << "\n";
+    }
+    else
+    {
+        BMPFileHeader header;
+        header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + palette_size;
+        header.file_size = header.offset_data + static_cast<uint32_t>(data_size);
+
+        BMPInfoHeader info;
+        info.size = sizeof(BMPInfoHeader);
+        info.width = out_width;
+        info.height = out_height;
+        info.bit_count = output_format == OutputFormat::Bmp1 ? 1 : 8;
+        info.size_image = static_cast<uint32_t>(data_size);
+
+        onp.write((const char*)&header, sizeof(BMPFileHeader));
+        if (output_format == OutputFormat::Bmp1)
+        {// index 0 is black, index 1 white
+            const uint32_t palette[2] = { 0x00000000, 0x00ffffff };
+            info.colors_used = 2;
+            onp.write((const char*)&info, sizeof(BMPInfoHeader));
+            onp.write((const char*)palette, sizeof(palette));
+        }
+        else
+        {
+            BMPColorHeader colors;
+            onp.write((const char*)&info, sizeof(BMPInfoHeader));
+            onp.write((const char*)&colors, sizeof(BMPColorHeader));
+        }
+    }
+    stats.bytes_out = static_cast<uint64_t>(onp.tellp());
+    end_stage(options, CoderStage::Write, 0, header_start, stats.bytes_out, stats.write_seconds);
+
+    // Windows of bands go through three stages: the reader thread faults in the mapped bands
+    // of window k + 1 while the pool decodes window k straight from the mapping and the writer
+    // thread writes window k - 1, so only two windows of pixels are ever held. The 1-bit
+    // outputs are packed band by band. PBM starts with the top row, the archive with the
+    // bottom one, so there the windows and the rows in them are taken from the top.
+    const bool top_first = output_format == OutputFormat::Pbm;
+    hash_to(top_first ? data + size : layout.rows); // the bands of PBM come top first
+    const unsigned int threads = pool->size();
+    const unsigned int window_rows = static_cast<unsigned int>(std::min<uint64_t>(
+        static_cast<uint64_t>(layout.table ? window_bands(threads) : 1) * layout.header.band_rows, std::max(out_height, 1u)));
+    const unsigned int windows = (out_height + window_rows - 1) / window_rows;
+    const size_t slot_size = window_rows * alligned_width;
+    pixel_arena.resize(std::min(windows, 2u) * slot_size);
+    if (pixel_format != PixelFormat::Gray8)
+    {
+        row_scratch.resize(pool->size() * 2 * static_cast<size_t>(out_width));
+    }
+    auto first_row = [&](const unsigned int window)
+    {
+        return (top_first ? windows - 1 - window : window) * window_rows;
+    };
+    auto row_count = [&](const unsigned int window) { return std::min(window_rows, out_height - first_row(window)); };
+    // the stages only touch their own stats fields, they are read once the stages are drained
+    auto read = [&](const unsigned int window)
+    {
+        const Clock::time_point read_start = Clock::now();
+        const unsigned int first_band = first_row(window) / layout.header.band_rows;
+        const unsigned int last_band = (first_row(window) + row_count(window) - 1) / layout.header.band_rows + 1;
+        const uint64_t bytes = layout.offset(last_band) - layout.offset(first_band);
+        if (file)
+        {
+            file->prefetch(layout.rows - file->data() + layout.offset(first_band), bytes);
+        }
+        if (hashed == layout.rows + layout.offset(first_band))
+        {
+            hash_to(layout.rows + layout.offset(last_band));
+        }
+        stats.bytes_in += bytes;
+        end_stage(options, CoderStage::Load, window, read_start, bytes, stats.load_seconds);
+    };
+    auto write = [&](const unsigned int window)
+    {
+        const Clock::time_point write_start = Clock::now();
+        const unsigned char *const slot = pixel_arena.data() + (window % 2) * slot_size;
+        if (top_first)
+        {
+            for (unsigned int row = row_count(window); row > 0; --row)
+            {
+                onp.write((const char*)slot + (row - 1) * alligned_width, alligned_width);
+            }
+        }
+        else
+        {
+            onp.write((const char*)slot, row_count(window) * alligned_width);
+        }
+        if (!onp)
+        {
+            throw std::runtime_error("Unable to write the output image file.");
+        }
+        const uint64_t bytes = static_cast<uint64_t>(row_count(window)) * alligned_width;
+        stats.bytes_out += bytes;
+        end_stage(options, CoderStage::Write, window, write_start, bytes, stats.write_seconds);
+    };
+    if (!reader)
+    {
+        reader.reset(new StageThread());
+        writer.reset(new StageThread());
+    }
+    reader->start(read);
+    writer->start(write);
+    try
+    {
+        for (unsigned int window = 0; window < std::min(windows, 2u); ++window)
+        {
+            reader->post(window);
+        }
+        for (unsigned int window = 0; window < windows; ++window)
+        {
+            reader->wait();
+            if (writer->pending() == 2)
+            {// pixel slot window % 2 is still being written
+                writer->wait();
+            }
+            const Clock::time_point decode_start = Clock::now();
+            decode_image(layout, first_row(window), row_count(window), pixel_arena.data() + (window % 2) * slot_size,
+                         alligned_width, *pool, stats.rows, pixel_format, row_scratch.data(), control.cancel);
+            end_stage(options, CoderStage::Decode, window, decode_start,
+                      static_cast<uint64_t>(row_count(window)) * alligned_width, stats.decode_seconds);
+            writer->post(window);
+            if (window + 2 < windows)
+            {
+                reader->post(window + 2);
+            }
+            if (control.progress)
+            {
+                control.progress(std::min(window_rows * (window + 1), out_height), out_height);
+            }
+        }
+        while (writer->pending() > 0)
+        {
+            writer->wait();
+        }
+    }
+    catch (...)
+    {
+        reader->drain();
+        writer->drain();
+        throw;
+    }
+    hash_to(data + size); // whatever follows the last band
+    output_file.keep();
+}
+
+const std::vector<unsigned char> &Decoder::decompress(const unsigned char *data, const size_t size, BarchInfo &info)
+{
+    const BarchLayout layout = read_decoder_layout(data, size, options);
+    info = barch_info(layout);
+    pixel_arena.resize(static_cast<size_t>(info.width) * info.height);
+    decode_in_memory(layout, 0, info.height, pixel_arena.data(), info.width, size, *pool, options, last_stats);
+    return pixel_arena;
+}
+
+BarchInfo Decoder::decompress(const unsigned char *data, const size_t size, unsigned char *pixels, const size_t stride,
+                              const size_t capacity)
+{
+    const BarchLayout layout = read_decoder_layout(data, size, options);
+    const BarchInfo info = barch_info(layout);
+    if (stride < info.width || (info.height > 0 && stride > 0 && capacity / stride < info.height))
+    {
+        throw std::length_error("The pixel buffer is too small for the decompressed image.");
+    }
+    decode_in_memory(layout, 0, info.height, pixels, stride, size, *pool, options, last_stats);
+    return info;
+}
+
+int Decoder::decompress_rows(const std::string &file_name_in, const unsigned int first_row, const unsigned int row_count,
+                             std::vector<unsigned char> &pixels)
+{
+    const auto file = open_barch(file_name_in, options.map_files);
+    const BarchLayout layout = read_decoder_layout(file->data(), file->size(), options);
+    if (row_count == 0 || first_row >= layout.header.height || row_count > layout.header.height - first_row)
+    {
+        throw std::runtime_error("Error! The requested rows are outside of the image.");
+    }
+    // only the bands holding the requested rows are touched
+    pixels.resize(static_cast<size_t>(layout.header.width) * row_count);
+    decode_in_memory(layout, first_row, row_count, pixels.data(), layout.header.width, file->size(), *pool, options,
+                     last_stats);
+    return 0;
+}
+
+PreviewInfo Decoder::decompress_preview(const std::string &file_name_in, const PreviewRegion &region,
+                                        std::vector<unsigned char> &pixels)
+{
+    const auto file = open_barch(file_name_in, options.map_files);
+    return decompress_preview(file->data(), file->size(), region, pixels);
+}
+
+PreviewInfo Decoder::decompress_preview(const unsigned char *data, const size_t size, const PreviewRegion &region,
+                                        std::vector<unsigned char> &pixels)
+{
+    const Clock::time_point start = Clock::now();
+    last_stats = CoderStats();
+    const BarchLayout layout = read_decoder_layout(data, size, options);
+    const unsigned int width = layout.header.width;
+    const unsigned int height = layout.header.height;
+    PreviewScale scale = { width, 0, 0, 0 };
+    auto valid = [](const unsigned int factor) { return factor == 1 || factor == 2 || factor == 4 || factor == 8; };
+    if (!valid(region.scale_x) || !valid(region.scale_y))
+    {
+        throw std::runtime_error("Error! Preview scales are 1, 2, 4 or 8.");
+    }
+    while ((1u << scale.shift_x) < region.scale_x)
+    {
+        ++scale.shift_x;
+    }
+    while ((1u << scale.shift_y) < region.scale_y)
+    {
+        ++scale.shift_y;
+    }
+    if (region.row_count == 0 || region.first_row >= height)
+    {
+        throw std::runtime_error("Error! The requested rows are outside of the image.");
+    }
+
+    // the rows are widened to whole blocks, the blocks are counted from row 0
+    const unsigned int first_row = region.first_row & ~(region.scale_y - 1);
+    const unsigned int last_row = static_cast<unsigned int>(std::min<uint64_t>(
+        height, (static_cast<uint64_t>(region.first_row) + region.row_count + region.scale_y - 1) & ~uint64_t(region.scale_y - 1)));
+    PreviewInfo info;
+    info.width = static_cast<unsigned int>((static_cast<uint64_t>(width) + region.scale_x - 1) >> scale.shift_x);
+    info.height = (last_row - first_row + region.scale_y - 1) >> scale.shift_y;
+    info.first_row = first_row;
+    info.row_count = last_row - first_row;
+    info.image = barch_info(layout);
+    scale.out_width = info.width;
+    pixels.resize(static_cast<size_t>(info.width) * info.height);
+    if (region.scale_x == 1 && region.scale_y == 1)
+    {// blocks of one pixel are the pixels
+        decode_image(layout, first_row, info.row_count, pixels.data(), width, *pool, last_stats.rows);
+    }
+    else
+    {
+        row_scratch.resize(pool->size() * 2 * static_cast<size_t>(width));
+        block_sums.resize(pool->size() * static_cast<size_t>(info.width));
+        decode_preview(layout, first_row, info.row_count, scale, pixels.data(), *pool, row_scratch.data(),
+                       block_sums.data(), last_stats.rows);
+    }
+    last_stats.bytes_in = size;
+    last_stats.bytes_out = pixels.size();
+    end_stage(options, CoderStage::Decode, 0, start, last_stats.bytes_out, last_stats.decode_seconds);
+    last_stats.total_seconds = seconds_since(start);
+    return info;
+}
+
+int decompress(const std::string &file_name_in, const std::string &file_name_out, const CoderOptions &options,
+               CoderStats *stats, const CoderControl &control)
+{
+    Decoder decoder(options);
+    const int result = decoder.decompress(file_name_in, file_name_out, control);
+    if (stats)
+    {
+        *stats = decoder.stats();
+    }
+    return result;
+}
+
+PreviewInfo decompress_preview(const std::string &file_name_in, const PreviewRegion &region,
+                               std::vector<unsigned char> &pixels, const CoderOptions &options)
+{
+    return Decoder(options).decompress_preview(file_name_in, region, pixels);
+}
+
+PreviewInfo decompress_preview(const unsigned char *data, const size_t size, const PreviewRegion &region,
+                               std::vector<unsigned char> &pixels, const CoderOptions &options)
+{
+    return Decoder(options).decompress_preview(data, size, region, pixels);
+}
+
+BarchInfo read_barch_info(const std::string &file_name)
+{
+    const auto file = open_barch(file_name, true);
+    return barch_info(read_barch_layout(file->data(), file->size()));
+}
+
+BarchInfo read_barch_info(const unsigned char *data, const size_t size)
+{
+    return barch_info(read_barch_layout(data, size));
+}
+
+int decompress_rows(const std::string &file_name_in, const unsigned int first_row, const unsigned int row_count,
+                    std::vector<unsigned char> &pixels, const CoderOptions &options)
+{
+    return Decoder(options).decompress_rows(file_name_in, first_row, row_count, pixels);
+}
+
+BarchInfo decompress_buffer(const unsigned char *data, const size_t size, unsigned char *pixels, const size_t stride,
+                            const size_t capacity, const CoderOptions &options)
+{
+    return Decoder(options).decompress(data, size, pixels, stride, capacity);
+}
+
+BarchInfo decompress_buffer(const unsigned char *data, const size_t size, std::vector<unsigned char> &pixels,
+                            const CoderOptions &options)
+{
+    const BarchInfo info = barch_info(read_decoder_layout(data, size, options));
+    pixels.resize(static_cast<size_t>(info.width) * info.height);
+    return decompress_buffer(data, size, pixels.data(), info.width, pixels.size(), options);
+}
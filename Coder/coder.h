@@ -1,10 +1,333 @@
-#ifndef CODER_H
-#define CODER_H
-
-#include <string>
-
-int compress(const std::string &file_name_in, const std::string &file_name_out);
-
-int decompress(const std::string &file_name_in, const std::string &file_name_out);
-
-#endif // CODER_H
+#ifndef CODER_H
+#define CODER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class ResultCache;
+
+// File written by decompress().
+enum class OutputFormat
+{
+    Bmp8, // 8-bit BMP, one 0x00/0xff byte per pixel
+    Bmp1, // 1-bit BMP with a black and white palette, eight times smaller
+    Pbm   // binary PBM (P4), packed like Bmp1 without the row padding, top row first
+};
+
+// Stages of a coder call, as reported in CoderStats and to CoderOptions::trace.
+enum class CoderStage
+{
+    Parse,  // opening the input and reading its headers
+    Load,   // reading pixel rows, or faulting in archive bands
+    Encode,
+    Decode,
+    Write   // writing the output file
+};
+
+// One stage of one window of bands, reported when it ends. Per-call stages have window 0.
+struct TraceEvent
+{
+    CoderStage stage;
+    unsigned int window;
+    std::chrono::steady_clock::time_point start;
+    double seconds;
+    uint64_t bytes;
+};
+
+struct CoderOptions
+{
+    // Worker threads for a single image, 0 uses every hardware thread.
+    unsigned int threads = 1;
+    // .barch container written by compress(): 2 has a band table for parallel and random
+    // access decoding and takes any size, switching to varint row sizes for rows too wide
+    // for a 16-bit size. 1 is the original layout with 16-bit dimensions, larger images throw.
+    unsigned int version = 2;
+    // v2 rows may also be stored as run lengths or as their difference from the row before,
+    // whichever is smallest. false keeps the v1 bit codes for every row.
+    bool row_modes = true;
+    // Pixels of compress() whose every channel is at this level or above are white, the others
+    // black. 0xff keeps only pure white; 1-bit images have no levels and ignore it.
+    unsigned int white_level = 0xff;
+    // Inputs are memory mapped and read in place, false reads them through a buffered stream.
+    bool map_files = true;
+    // The decoders refuse images of more pixels, so that a forged header can't make them
+    // allocate beyond reason. 0 takes any size.
+    uint64_t max_pixels = uint64_t(1) << 32;
+    // Layout of the files written by decompress().
+    OutputFormat output_format = OutputFormat::Bmp8;
+    // Receives every TraceEvent, from the thread that ran the stage, so it must be thread safe.
+    // Left empty it costs a branch per stage and window.
+    std::function<void(const TraceEvent&)> trace;
+    // File calls whose output the cache knows to be up to date return without coding, the
+    // others record their output in it. Several coders, on any threads, may share one cache.
+    std::shared_ptr<ResultCache> cache;
+};
+
+// Rows by the way they are stored, see CoderOptions::row_modes. Bad rows are only counted
+// when decoding: their data didn't match the width and they were decoded as far as it went.
+struct RowTypeCounts
+{
+    uint64_t empty = 0;
+    uint64_t codes = 0;
+    uint64_t runs = 0;
+    uint64_t delta = 0;
+    uint64_t bad = 0;
+
+    RowTypeCounts &operator+=(const RowTypeCounts &other)
+    {
+        empty += other.empty;
+        codes += other.codes;
+        runs += other.runs;
+        delta += other.delta;
+        bad += other.bad;
+        return *this;
+    }
+};
+
+// What one call of the coder did. The stage times add up every window; the file pipeline
+// runs loading, coding and writing side by side, so they may sum to more than the total.
+struct CoderStats
+{
+    double parse_seconds = 0;
+    double load_seconds = 0;
+    double encode_seconds = 0;
+    double decode_seconds = 0;
+    double write_seconds = 0;
+    double total_seconds = 0;
+    uint64_t bytes_in = 0;  // pixel rows or archive bytes read
+    uint64_t bytes_out = 0; // archive or pixel bytes produced, headers included for files
+    RowTypeCounts rows;
+    bool cached = false; // the output was already up to date, nothing was coded
+};
+
+// Layout of the pixels handed to the encoder and what counts as white in it, everything
+// else is black.
+enum class PixelFormat
+{
+    Gray8,         // one byte per pixel, 0xff is white
+    Mono1,         // one bit per pixel, most significant bit first, a set bit is white
+    Mono1Inverted, // as Mono1, a set bit is black
+    Bgr24,         // three bytes per pixel, white is 0xff in all of them
+    Bgra32         // as Bgr24 with a fourth byte that is ignored
+};
+
+// Pixels held in memory. Rows are `stride` bytes apart and are stored in this order
+// (bottom-up for pixels taken from a BMP file). A format left out of the initializer is Gray8.
+struct PixelSpan
+{
+    const unsigned char *data;
+    unsigned int width;
+    unsigned int height;
+    size_t stride;
+    PixelFormat format;
+};
+
+struct BarchInfo
+{
+    unsigned int width;
+    unsigned int height;
+    unsigned int version;
+};
+
+// Rows of an image decoded by decompress_preview() and how far they are shrunk: of every
+// scale_y rows the first is kept, and every scale_x pixels of it become one grey pixel, 0x00
+// when all are black, 0xff when all are white and their share of white in between. Scales are
+// 1, 2, 4 or 8. Blocks are counted from row 0, so the rows are widened to whole blocks; rows
+// past the image are left out.
+struct PreviewRegion
+{
+    unsigned int first_row;
+    unsigned int row_count;
+    unsigned int scale_x;
+    unsigned int scale_y;
+};
+
+struct PreviewInfo
+{
+    unsigned int width;     // of the preview
+    unsigned int height;
+    unsigned int first_row; // rows of the image it covers
+    unsigned int row_count;
+    BarchInfo image;
+};
+
+// Lets the caller of a long file call follow it and stop it.
+struct CoderControl
+{
+    // Called with the rows done so far after every window of bands, from the calling thread.
+    std::function<void(unsigned int rows_done, unsigned int rows_total)> progress;
+    // Checked before every band, may be set from any thread. A cancelled call removes the
+    // output it has written so far and throws CoderCancelled.
+    const std::atomic<bool> *cancel = nullptr;
+};
+
+class CoderCancelled : public std::runtime_error
+{
+public:
+    CoderCancelled()
+        : std::runtime_error("The operation was cancelled.")
+    {}
+};
+
+// The file functions fill in `stats` when given one. A call that fails for any reason leaves
+// no output file behind.
+int compress(const std::string &file_name_in, const std::string &file_name_out, const CoderOptions &options = CoderOptions(),
+             CoderStats *stats = nullptr, const CoderControl &control = CoderControl());
+
+int decompress(const std::string &file_name_in, const std::string &file_name_out, const CoderOptions &options = CoderOptions(),
+               CoderStats *stats = nullptr, const CoderControl &control = CoderControl());
+
+BarchInfo read_barch_info(const std::string &file_name);
+
+// Decodes rows [first_row, first_row + row_count) of a .barch file into `pixels`, one 0x00/0xff
+// byte per pixel and width bytes per row, in the bottom-up row order of the source bitmap.
+// v2 files read only the bands holding those rows.
+int decompress_rows(const std::string &file_name_in, const unsigned int first_row, const unsigned int row_count,
+                    std::vector<unsigned char> &pixels, const CoderOptions &options = CoderOptions());
+
+// The buffer functions below never touch the filesystem. Apart from the output they only
+// allocate per-call scratch memory and worker threads, Encoder and Decoder keep those.
+
+// Size of a caller-supplied buffer that always fits compress_buffer() with these options.
+size_t compress_bound(const unsigned int width, const unsigned int height, const CoderOptions &options = CoderOptions());
+
+// Encodes pixels into a .barch image. The vector grows as needed, a caller-supplied buffer
+// that turns out too small throws std::length_error. Returns the size of the image.
+size_t compress_buffer(const PixelSpan &pixels, std::vector<unsigned char> &out, const CoderOptions &options = CoderOptions());
+
+size_t compress_buffer(const PixelSpan &pixels, unsigned char *out, const size_t capacity,
+                       const CoderOptions &options = CoderOptions());
+
+BarchInfo read_barch_info(const unsigned char *data, const size_t size);
+
+// Decodes a .barch image held in memory into one 0x00/0xff byte per pixel, rows `stride`
+// bytes apart; bytes between the width and the stride are zeroed. A caller-supplied buffer
+// needs height * stride bytes, the vector is resized to width * height.
+BarchInfo decompress_buffer(const unsigned char *data, const size_t size, unsigned char *pixels, const size_t stride,
+                            const size_t capacity, const CoderOptions &options = CoderOptions());
+
+BarchInfo decompress_buffer(const unsigned char *data, const size_t size, std::vector<unsigned char> &pixels,
+                            const CoderOptions &options = CoderOptions());
+
+// Decodes a preview of rows of a .barch image into `pixels`, one grey byte per block and
+// PreviewInfo::width bytes per row, in the bottom-up row order of the source bitmap. Only the
+// bands holding the rows are read, the rows that aren't kept are stepped over by their size
+// prefix and the kept ones are added up block by block from their codes and run lengths
+// without expanding them to pixels, so a preview costs a fraction of decoding the rows.
+PreviewInfo decompress_preview(const std::string &file_name_in, const PreviewRegion &region,
+                               std::vector<unsigned char> &pixels, const CoderOptions &options = CoderOptions());
+
+PreviewInfo decompress_preview(const unsigned char *data, const size_t size, const PreviewRegion &region,
+                               std::vector<unsigned char> &pixels, const CoderOptions &options = CoderOptions());
+
+// Encodes a BMP file into a .barch image held in memory, for callers that store the image
+// somewhere else than a file of its own.
+size_t compress_to_buffer(const std::string &file_name_in, std::vector<unsigned char> &out,
+                          const CoderOptions &options = CoderOptions());
+
+class ContentHasher;
+class MappedFile;
+class StageThread;
+class WorkerPool;
+
+// Compression context. It keeps its worker threads, scratch memory and output arena from
+// call to call, so compressing a stream of same-sized images from memory makes no heap
+// allocations after the first one. Files are read and written by two more threads, started
+// on the first file and kept for the next ones, overlapping the disk with the encoding.
+// One Encoder must not be used by several threads at once.
+class Encoder
+{
+public:
+    explicit Encoder(const CoderOptions &options = CoderOptions());
+    ~Encoder();
+
+    Encoder(const Encoder&) = delete;
+    void operator=(const Encoder&) = delete;
+
+    // Encodes into the encoder's output arena, valid until the next call.
+    const std::vector<unsigned char> &compress(const PixelSpan &pixels);
+
+    // Encodes into a caller-supplied buffer, see compress_buffer().
+    size_t compress(const PixelSpan &pixels, unsigned char *out, const size_t capacity);
+
+    int compress(const std::string &file_name_in, const std::string &file_name_out,
+                 const CoderControl &control = CoderControl());
+
+    // Stats of the last call.
+    const CoderStats &stats() const { return last_stats; }
+
+private:
+    CoderOptions options;
+    CoderStats last_stats;
+    std::unique_ptr<WorkerPool> pool;
+    std::vector<std::vector<uint64_t>> row_masks;
+    std::vector<unsigned char> input_windows[2];
+    std::vector<uint64_t> offsets;
+    std::vector<unsigned char> output;
+    std::unique_ptr<StageThread> reader;
+    std::unique_ptr<StageThread> writer;
+};
+
+// Decompression context, the counterpart of Encoder. Decoding files, it prefetches the
+// bands ahead and writes the decoded rows behind the decoding on threads of its own.
+class Decoder
+{
+public:
+    explicit Decoder(const CoderOptions &options = CoderOptions());
+    ~Decoder();
+
+    Decoder(const Decoder&) = delete;
+    void operator=(const Decoder&) = delete;
+
+    // Decodes into the decoder's pixel arena, width bytes per row, valid until the next call.
+    const std::vector<unsigned char> &decompress(const unsigned char *data, const size_t size, BarchInfo &info);
+
+    // Decodes into a caller-supplied buffer, see decompress_buffer().
+    BarchInfo decompress(const unsigned char *data, const size_t size, unsigned char *pixels, const size_t stride,
+                         const size_t capacity);
+
+    int decompress(const std::string &file_name_in, const std::string &file_name_out,
+                   const CoderControl &control = CoderControl());
+
+    // Decodes a .barch image held in memory into a file, see decompress().
+    int decompress(const unsigned char *data, const size_t size, const std::string &file_name_out,
+                   const CoderControl &control = CoderControl());
+
+    int decompress_rows(const std::string &file_name_in, const unsigned int first_row, const unsigned int row_count,
+                        std::vector<unsigned char> &pixels);
+
+    // See the free decompress_preview().
+    PreviewInfo decompress_preview(const std::string &file_name_in, const PreviewRegion &region,
+                                   std::vector<unsigned char> &pixels);
+
+    PreviewInfo decompress_preview(const unsigned char *data, const size_t size, const PreviewRegion &region,
+                                   std::vector<unsigned char> &pixels);
+
+    // Stats of the last call.
+    const CoderStats &stats() const { return last_stats; }
+
+private:
+    // Bands are prefetched from `file` when the image lies in one, and the whole archive is
+    // hashed into `hasher` on the way unless it is null.
+    void write_image(const MappedFile *file, const unsigned char *data, const size_t size,
+                     const std::string &file_name_out, const CoderControl &control,
+                     const std::chrono::steady_clock::time_point start, ContentHasher *hasher);
+
+    CoderOptions options;
+    CoderStats last_stats;
+    std::unique_ptr<WorkerPool> pool;
+    std::vector<unsigned char> pixel_arena;
+    std::vector<unsigned char> row_scratch;
+    std::vector<uint16_t> block_sums;
+    std::unique_ptr<StageThread> reader;
+    std::unique_ptr<StageThread> writer;
+};
+
+#endif // CODER_H
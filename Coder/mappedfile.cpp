@@ -0,0 +1,169 @@
+#include "mappedfile.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string &file_name, const bool allow_mapping, const bool read_fallback)
+    : view(nullptr)
+    , length(0)
+    , mapped(false)
+#if defined(_WIN32)
+    , mapping(nullptr)
+#endif
+{
+    if (allow_mapping)
+    {
+        map(file_name);
+    }
+    if (!mapped && read_fallback)
+    {
+        read(file_name);
+    }
+}
+
+void MappedFile::release(const size_t offset, const size_t size)
+{
+#if !defined(_WIN32)
+    if (!mapped)
+    {
+        return;
+    }
+    // only the pages lying completely inside the range are dropped
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t begin = (offset + page - 1) / page * page;
+    const size_t end = std::min(offset + size, length) / page * page;
+    if (begin < end)
+    {
+        madvise(const_cast<unsigned char*>(view) + begin, end - begin, MADV_DONTNEED);
+    }
+#else
+    (void)offset;
+    (void)size;
+#endif
+}
+
+void MappedFile::prefetch(const size_t offset, const size_t size) const
+{
+    if (!mapped || offset >= length)
+    {
+        return;
+    }
+    const size_t end = std::min(offset + size, length);
+#if defined(_WIN32)
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    const size_t page = system_info.dwPageSize;
+#else
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t begin = offset / page * page;
+    madvise(const_cast<unsigned char*>(view) + begin, end - begin, MADV_WILLNEED);
+#endif
+    // one read per page faults it in
+    unsigned char sum = 0;
+    for (size_t it = offset; it < end; it += page)
+    {
+        sum += static_cast<const volatile unsigned char*>(view)[it];
+    }
+    sum += static_cast<const volatile unsigned char*>(view)[end - 1];
+    (void)sum;
+}
+
+MappedFile::~MappedFile()
+{
+    if (!mapped)
+    {
+        return;
+    }
+#if defined(_WIN32)
+    UnmapViewOfFile(view);
+    CloseHandle(mapping);
+#else
+    munmap(const_cast<unsigned char*>(view), length);
+#endif
+}
+
+#if defined(_WIN32)
+
+void MappedFile::map(const std::string &file_name)
+{
+    HANDLE file = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+    {
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping)
+        {
+            view = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            if (view)
+            {
+                length = static_cast<size_t>(file_size.QuadPart);
+                mapped = true;
+            }
+            else
+            {
+                CloseHandle(mapping);
+                mapping = nullptr;
+            }
+        }
+    }
+    CloseHandle(file);
+}
+
+#else
+
+void MappedFile::map(const std::string &file_name)
+{
+    const int file = open(file_name.c_str(), O_RDONLY);
+    if (file < 0)
+    {
+        return;
+    }
+    struct stat file_stat;
+    if (fstat(file, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0)
+    {
+        void *address = mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+        if (address != MAP_FAILED)
+        {
+            madvise(address, static_cast<size_t>(file_stat.st_size), MADV_SEQUENTIAL);
+            view = static_cast<const unsigned char*>(address);
+            length = static_cast<size_t>(file_stat.st_size);
+            mapped = true;
+        }
+    }
+    close(file);
+}
+
+#endif
+
+void MappedFile::read(const std::string &file_name)
+{
+    std::ifstream inp{ file_name, std::ios_base::binary | std::ios_base::ate };
+    if (!inp)
+    {
+        throw std::runtime_error("Unable to open the input file.");
+    }
+    buffer.resize(static_cast<size_t>(inp.tellg()));
+    inp.seekg(0, inp.beg);
+    inp.read((char*)buffer.data(), buffer.size());
+    if (!inp)
+    {
+        throw std::runtime_error("Unable to read the input file.");
+    }
+    view = buffer.data();
+    length = buffer.size();
+}
@@ -0,0 +1,44 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Read-only view of a whole file. The file is memory mapped when the platform allows it,
+// otherwise (or when mapping is not wanted) it is read into a buffer with a buffered stream.
+// Without read_fallback a file that can't be mapped is left empty, see is_mapped().
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string &file_name, const bool allow_mapping = true, const bool read_fallback = true);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    void operator=(const MappedFile&) = delete;
+
+    const unsigned char *data() const { return view; }
+    size_t size() const { return length; }
+    bool is_mapped() const { return mapped; }
+
+    // Hints that [offset, offset + size) won't be read again, its pages can leave memory.
+    void release(const size_t offset, const size_t size);
+
+    // Pulls the pages of [offset, offset + size) into memory now, blocking until they are
+    // there, so that later reads of the range don't wait on the disk.
+    void prefetch(const size_t offset, const size_t size) const;
+
+private:
+    void map(const std::string &file_name);
+    void read(const std::string &file_name);
+
+    const unsigned char *view;
+    size_t length;
+    bool mapped;
+    std::vector<unsigned char> buffer;
+#if defined(_WIN32)
+    void *mapping;
+#endif
+};
+
+#endif // MAPPEDFILE_H
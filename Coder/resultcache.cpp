@@ -0,0 +1,370 @@
+#include "resultcache.h"
+#include "mappedfile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace
+{
+
+const uint64_t prime1 = 0x9e3779b185ebca87ull;
+const uint64_t prime2 = 0xc2b2ae3d27d4eb4full;
+const uint64_t prime3 = 0x165667b19e3779f9ull;
+
+uint64_t rotate_left(const uint64_t value, const unsigned int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+uint64_t load_word(const unsigned char *data)
+{
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+uint64_t mix_word(const uint64_t lane, const uint64_t word)
+{
+    return rotate_left(lane + word * prime2, 31) * prime1;
+}
+
+const char index_magic[8] = { 'B', 'A', 'R', 'C', 'H', 'I', 'D', 'X' };
+const uint32_t index_version = 1;
+
+bool hash_file(const std::string &file_name, uint64_t &hash)
+{
+    try
+    {
+        MappedFile file(file_name);
+        hash = content_hash(file.data(), file.size());
+        return true;
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
+
+template <typename T>
+void put(std::ofstream &out, const T &value)
+{
+    out.write((const char*)&value, sizeof(value));
+}
+
+void put_string(std::ofstream &out, const std::string &value)
+{
+    put(out, static_cast<uint32_t>(value.size()));
+    out.write(value.data(), value.size());
+}
+
+template <typename T>
+bool get(std::ifstream &in, T &value)
+{
+    return static_cast<bool>(in.read((char*)&value, sizeof(value)));
+}
+
+bool get_string(std::ifstream &in, std::string &value)
+{
+    uint32_t size = 0;
+    if (!get(in, size) || size > 0xffff)
+    {
+        return false;
+    }
+    value.resize(size);
+    return size == 0 || static_cast<bool>(in.read(&value[0], size));
+}
+
+const uint64_t initial_lanes[4] = { prime1 + prime2, prime2, 0, 0 - prime1 };
+
+void mix_block(uint64_t lanes[4], const unsigned char *block)
+{
+    lanes[0] = mix_word(lanes[0], load_word(block));
+    lanes[1] = mix_word(lanes[1], load_word(block + 8));
+    lanes[2] = mix_word(lanes[2], load_word(block + 16));
+    lanes[3] = mix_word(lanes[3], load_word(block + 24));
+}
+
+// Folds the lanes, the last 0-31 bytes and the size into the hash.
+uint64_t finish_hash(const uint64_t lanes[4], const unsigned char *tail, const size_t tail_size, const uint64_t size)
+{
+    uint64_t hash = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) + rotate_left(lanes[2], 12)
+                  + rotate_left(lanes[3], 18) + size;
+    size_t it = 0;
+    for (; it + 8 <= tail_size; it += 8)
+    {
+        hash = rotate_left(hash ^ mix_word(0, load_word(tail + it)), 27) * prime1 + prime3;
+    }
+    for (; it < tail_size; ++it)
+    {
+        hash = rotate_left(hash ^ (tail[it] * prime3), 11) * prime1;
+    }
+    // every input bit ends up affecting every output bit
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+}
+
+uint64_t content_hash(const unsigned char *data, const size_t size)
+{
+    uint64_t lanes[4];
+    std::memcpy(lanes, initial_lanes, sizeof(lanes));
+    size_t it = 0;
+    for (; it + 32 <= size; it += 32)
+    {
+        mix_block(lanes, data + it);
+    }
+    return finish_hash(lanes, data + it, size - it, size);
+}
+
+ContentHasher::ContentHasher()
+    : pending_size(0)
+    , total(0)
+{
+    std::memcpy(lanes, initial_lanes, sizeof(lanes));
+}
+
+void ContentHasher::update(const unsigned char *data, size_t size)
+{
+    if (size == 0)
+    {
+        return;
+    }
+    total += size;
+    if (pending_size > 0)
+    {
+        const size_t taken = std::min(size, sizeof(pending) - pending_size);
+        std::memcpy(pending + pending_size, data, taken);
+        pending_size += taken;
+        data += taken;
+        size -= taken;
+        if (pending_size < sizeof(pending))
+        {
+            return;
+        }
+        mix_block(lanes, pending);
+        pending_size = 0;
+    }
+    for (; size >= 32; data += 32, size -= 32)
+    {
+        mix_block(lanes, data);
+    }
+    std::memcpy(pending, data, size);
+    pending_size = size;
+}
+
+uint64_t ContentHasher::value() const
+{
+    return finish_hash(lanes, pending, pending_size, total);
+}
+
+bool ResultCache::stamp_of(const std::string &file_name, FileStamp &stamp)
+{
+#if defined(_WIN32)
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(file_name.c_str(), GetFileExInfoStandard, &data)
+        || (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+    {
+        return false;
+    }
+    stamp.size = (static_cast<uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+    stamp.time = static_cast<int64_t>((static_cast<uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32)
+                                      | data.ftLastWriteTime.dwLowDateTime);
+#else
+    struct stat file_stat;
+    if (stat(file_name.c_str(), &file_stat) != 0 || !S_ISREG(file_stat.st_mode))
+    {
+        return false;
+    }
+    stamp.size = static_cast<uint64_t>(file_stat.st_size);
+#if defined(__APPLE__)
+    stamp.time = static_cast<int64_t>(file_stat.st_mtimespec.tv_sec) * 1000000000 + file_stat.st_mtimespec.tv_nsec;
+#else
+    stamp.time = static_cast<int64_t>(file_stat.st_mtim.tv_sec) * 1000000000 + file_stat.st_mtim.tv_nsec;
+#endif
+#endif
+    return true;
+}
+
+ResultCache::ResultCache(const std::string &index_file)
+    : index_file(index_file)
+    , dirty(false)
+    , hit_count(0)
+    , miss_count(0)
+{
+    load();
+}
+
+ResultCache::~ResultCache()
+{
+    try
+    {
+        save();
+    }
+    catch (const std::exception&)
+    {
+        // the records are only lost, the next run codes the files again
+    }
+}
+
+bool ResultCache::lookup(const std::string &file_name_in, const std::string &file_name_out, const uint32_t key)
+{
+    Record record;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto found = records.find(file_name_out);
+        if (found == records.end() || found->second.input != file_name_in || found->second.key != key)
+        {
+            ++miss_count;
+            return false;
+        }
+        record = found->second;
+    }
+
+    FileStamp input;
+    FileStamp output;
+    if (!stamp_of(file_name_out, output) || output.size != record.output_stamp.size
+        || output.time != record.output_stamp.time
+        || !stamp_of(file_name_in, input) || input.size != record.input_stamp.size)
+    {
+        ++miss_count;
+        return false;
+    }
+    // the stamps alone are trusted unless the input changed since, or changed within the
+    // same clock tick the output was written in, where the time can't tell the writes apart
+    if (input.time != record.input_stamp.time || input.time >= output.time)
+    {
+        uint64_t hash = 0;
+        if (!hash_file(file_name_in, hash) || hash != record.input_hash)
+        {
+            ++miss_count;
+            return false;
+        }
+        if (input.time != record.input_stamp.time)
+        {
+            // touched but not changed, the new time saves hashing it the next time
+            std::lock_guard<std::mutex> lock(mutex);
+            const auto found = records.find(file_name_out);
+            if (found != records.end() && found->second.input_hash == hash)
+            {
+                found->second.input_stamp.time = input.time;
+                dirty = true;
+            }
+        }
+    }
+    ++hit_count;
+    return true;
+}
+
+void ResultCache::store(const std::string &file_name_in, const std::string &file_name_out, const uint32_t key,
+                        const FileStamp &input_stamp, const uint64_t input_hash)
+{
+    FileStamp output;
+    if (!stamp_of(file_name_out, output))
+    {
+        return;
+    }
+    const Record record = { file_name_in, key, input_stamp, input_hash, output };
+    std::lock_guard<std::mutex> lock(mutex);
+    records[file_name_out] = record;
+    dirty = true;
+}
+
+void ResultCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    dirty = dirty || !records.empty();
+    records.clear();
+}
+
+void ResultCache::load()
+{
+    if (index_file.empty())
+    {
+        return;
+    }
+    std::ifstream in(index_file, std::ios_base::binary);
+    char magic[sizeof(index_magic)];
+    uint32_t version = 0;
+    uint32_t count = 0;
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, index_magic, sizeof(magic)) != 0
+        || !get(in, version) || version != index_version || !get(in, count))
+    {
+        return;
+    }
+    // a damaged index is dropped as a whole, it only costs coding the files again
+    std::unordered_map<std::string, Record> loaded;
+    for (uint32_t it = 0; it < count; ++it)
+    {
+        std::string output;
+        Record record;
+        if (!get_string(in, output) || !get_string(in, record.input) || !get(in, record.key)
+            || !get(in, record.input_stamp.size) || !get(in, record.input_stamp.time) || !get(in, record.input_hash)
+            || !get(in, record.output_stamp.size) || !get(in, record.output_stamp.time))
+        {
+            return;
+        }
+        loaded[output] = record;
+    }
+    records.swap(loaded);
+}
+
+void ResultCache::save()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (index_file.empty() || !dirty)
+    {
+        return;
+    }
+    // written aside and renamed over the old index, a crash leaves one or the other
+    const std::string temporary = index_file + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios_base::binary | std::ios_base::trunc);
+        out.write(index_magic, sizeof(index_magic));
+        put(out, index_version);
+        put(out, static_cast<uint32_t>(records.size()));
+        for (const auto &entry : records)
+        {
+            const Record &record = entry.second;
+            put_string(out, entry.first);
+            put_string(out, record.input);
+            put(out, record.key);
+            put(out, record.input_stamp.size);
+            put(out, record.input_stamp.time);
+            put(out, record.input_hash);
+            put(out, record.output_stamp.size);
+            put(out, record.output_stamp.time);
+        }
+        out.close();
+        if (!out)
+        {
+            std::remove(temporary.c_str());
+            throw std::runtime_error("Unable to write the result cache index.");
+        }
+    }
+    if (std::rename(temporary.c_str(), index_file.c_str()) != 0)
+    {
+        // Windows doesn't rename over an existing file
+        std::remove(index_file.c_str());
+        if (std::rename(temporary.c_str(), index_file.c_str()) != 0)
+        {
+            std::remove(temporary.c_str());
+            throw std::runtime_error("Unable to write the result cache index.");
+        }
+    }
+    dirty = false;
+}
@@ -0,0 +1,101 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// 64-bit hash of a byte range, four multiply-rotate lanes over 8-byte words so that it runs
+// at memory speed. Not meant to resist a deliberate collision.
+uint64_t content_hash(const unsigned char *data, const size_t size);
+
+// content_hash() of bytes handed over piece by piece, in order, for a coder to hash its input
+// as it reads it.
+class ContentHasher
+{
+public:
+    ContentHasher();
+
+    void update(const unsigned char *data, size_t size);
+
+    // The hash of the bytes so far.
+    uint64_t value() const;
+
+    uint64_t size() const { return total; }
+
+private:
+    uint64_t lanes[4];
+    unsigned char pending[32]; // the start of a 32-byte block
+    size_t pending_size;
+    uint64_t total;
+};
+
+// Remembers which output files the coder wrote from which inputs, so that coding an input
+// again can be skipped while its output is still up to date. An input counts as unchanged
+// when its size and modification time match the record, or, when only the time moved, when
+// its content hash does. The output must still have the size and time it was written with.
+//
+// The records are kept in an index file, read by the constructor and written by save() and
+// the destructor; without a file name they only live as long as the cache. File names are
+// compared as given. One cache may be used by any number of threads at once.
+class ResultCache
+{
+public:
+    explicit ResultCache(const std::string &index_file = std::string());
+    ~ResultCache();
+
+    ResultCache(const ResultCache&) = delete;
+    void operator=(const ResultCache&) = delete;
+
+    // True when `file_name_out` still holds what coding `file_name_in` the way `key` stands
+    // for produced. Every call counts as a hit or a miss.
+    bool lookup(const std::string &file_name_in, const std::string &file_name_out, const uint32_t key);
+
+    struct FileStamp
+    {
+        uint64_t size;
+        int64_t time; // modification time, in the platform's finest unit
+    };
+
+    // False when the file can't be read or isn't a regular file.
+    static bool stamp_of(const std::string &file_name, FileStamp &stamp);
+
+    // Records that `file_name_out` was just written from `file_name_in`. The coder takes the
+    // input's stamp before reading it and hashes the bytes it codes as it reads them, so an
+    // input that changes while being coded doesn't match the record later.
+    void store(const std::string &file_name_in, const std::string &file_name_out, const uint32_t key,
+               const FileStamp &input_stamp, const uint64_t input_hash);
+
+    // Forgets every record, the counters are kept.
+    void clear();
+
+    // Writes the records to the index file when they changed. Throws when it can't be written.
+    void save();
+
+    uint64_t hits() const { return hit_count; }
+    uint64_t misses() const { return miss_count; }
+
+private:
+    struct Record
+    {
+        std::string input;
+        uint32_t key;
+        FileStamp input_stamp;
+        uint64_t input_hash;
+        FileStamp output_stamp;
+    };
+
+    void load();
+
+    std::string index_file;
+    std::mutex mutex;
+    std::unordered_map<std::string, Record> records; // by output file
+    bool dirty;
+    std::atomic<uint64_t> hit_count;
+    std::atomic<uint64_t> miss_count;
+};
+
+#endif // RESULTCACHE_H
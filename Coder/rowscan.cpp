@@ -0,0 +1,500 @@
+#include "rowscan.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define ROWSCAN_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(ROWSCAN_X86) && defined(__GNUC__)
+#define ROWSCAN_TARGET(isa) __attribute__((target(isa)))
+#else
+#define ROWSCAN_TARGET(isa)
+#endif
+
+namespace
+{
+
+// Classifies the pixels [from, width) one at a time with is_white(x), they all land in the
+// last mask word.
+template <typename IsWhite>
+bool classify_pixels(unsigned int from, const unsigned int width, uint64_t *mask, IsWhite is_white)
+{
+    if (from == width)
+    {
+        return true;
+    }
+    uint64_t bits = 0;
+    const unsigned int base = from & ~63u;
+    for (; from < width; ++from)
+    {
+        bits |= static_cast<uint64_t>(is_white(from)) << (from - base);
+    }
+    mask[base / 64] = bits;
+    return bits == (~uint64_t(0) >> (64 - (width - base)));
+}
+
+bool classify_tail(const unsigned char *row, const unsigned int from, const unsigned int width, uint64_t *mask)
+{
+    return classify_pixels(from, width, mask, [row](const unsigned int x) { return row[x] == 0xff; });
+}
+
+bool is_white_bgr(const unsigned char *pixel)
+{
+    return pixel[0] == 0xff && pixel[1] == 0xff && pixel[2] == 0xff;
+}
+
+bool classify_tail_bgr24(const unsigned char *row, const unsigned int from, const unsigned int width, uint64_t *mask)
+{
+    return classify_pixels(from, width, mask, [row](const unsigned int x) { return is_white_bgr(row + 3 * static_cast<size_t>(x)); });
+}
+
+bool classify_tail_bgra32(const unsigned char *row, const unsigned int from, const unsigned int width, uint64_t *mask)
+{
+    return classify_pixels(from, width, mask, [row](const unsigned int x) { return is_white_bgr(row + 4 * x); });
+}
+
+// Packs bits 0, 3, 6 ... 45 of a 48-bit mask into 16 bits, closing the gaps in four steps
+// that each halve the number of groups: pairs, quads, octets, then the two octets.
+inline uint64_t every_third_bit(uint64_t bits)
+{
+    bits &= 0x249249249249ull;
+    bits = (bits | (bits >> 2)) & 0x0c30c30c30c3ull;
+    bits = (bits | (bits >> 4)) & 0x00f00f00f00full;
+    bits = (bits | (bits >> 8)) & 0x0000ff0000ffull;
+    return (bits | (bits >> 16)) & 0xffff;
+}
+
+// Pixel layouts for the white level classifiers: the bytes a pixel takes and its darkest
+// channel, the one that decides whether it reaches the level.
+struct Gray8Pixel
+{
+    static const unsigned int bytes = 1;
+    static unsigned char level(const unsigned char *pixel) { return pixel[0]; }
+};
+
+struct Bgr24Pixel
+{
+    static const unsigned int bytes = 3;
+    static unsigned char level(const unsigned char *pixel) { return std::min(std::min(pixel[0], pixel[1]), pixel[2]); }
+};
+
+struct Bgra32Pixel
+{
+    static const unsigned int bytes = 4;
+    static unsigned char level(const unsigned char *pixel) { return std::min(std::min(pixel[0], pixel[1]), pixel[2]); }
+};
+
+template <typename Pixel>
+bool classify_level_pixels(const unsigned char *row, const unsigned int from, const unsigned int width,
+                           const unsigned char level, uint64_t *mask)
+{
+    return classify_pixels(from, width, mask, [row, level](const unsigned int x)
+    {
+        return Pixel::level(row + Pixel::bytes * static_cast<size_t>(x)) >= level;
+    });
+}
+
+// One classifier per pixel layout, the compare against the level is the same for all.
+template <typename Pixel>
+bool classify_level(const unsigned char *row, const unsigned int width, const unsigned char level, uint64_t *mask)
+{
+    const uint64_t all_white = ~uint64_t(0);
+    bool is_white = true;
+    unsigned int x = 0;
+    for (; x + 64 <= width; x += 64)
+    {
+        uint64_t bits = 0;
+        for (unsigned int it = 0; it < 64; ++it)
+        {
+            bits |= static_cast<uint64_t>(Pixel::level(row + Pixel::bytes * static_cast<size_t>(x + it)) >= level) << it;
+        }
+        mask[x / 64] = bits;
+        is_white = is_white && bits == all_white;
+    }
+    return classify_level_pixels<Pixel>(row, x, width, level, mask) && is_white;
+}
+
+// BMP keeps the leftmost pixel of a byte in its top bit, the mask in its lowest one.
+struct ReversedBits
+{
+    ReversedBits()
+    {
+        for (unsigned int byte = 0; byte < 256; ++byte)
+        {
+            unsigned char reversed = 0;
+            for (unsigned int bit = 0; bit < 8; ++bit)
+            {
+                reversed |= ((byte >> bit) & 1) << (7 - bit);
+            }
+            values[byte] = reversed;
+        }
+    }
+
+    unsigned char values[256];
+};
+
+const ReversedBits reversed_bits;
+
+// 64 pixels per mask word are eight bytes of the row, a solid word needs no reversing.
+bool classify_mono1(const unsigned char *row, const unsigned int width, uint64_t *mask, const uint64_t flip)
+{
+    const unsigned int words = row_mask_words(width);
+    const size_t bytes = (static_cast<size_t>(width) + 7) / 8;
+    bool is_white = true;
+    for (unsigned int word = 0; word < words; ++word)
+    {
+        const size_t first = static_cast<size_t>(word) * 8;
+        uint64_t bits = 0;
+        if (bytes - first >= 8)
+        {
+            std::memcpy(&bits, row + first, 8);
+            if (bits != 0 && bits != ~uint64_t(0))
+            {
+                uint64_t reversed = 0;
+                for (unsigned int it = 0; it < 8; ++it)
+                {
+                    reversed |= static_cast<uint64_t>(reversed_bits.values[row[first + it]]) << (8 * it);
+                }
+                bits = reversed;
+            }
+        }
+        else
+        {
+            for (size_t it = 0; first + it < bytes; ++it)
+            {
+                bits |= static_cast<uint64_t>(reversed_bits.values[row[first + it]]) << (8 * it);
+            }
+        }
+        bits ^= flip;
+        const uint64_t valid = word + 1 == words && width % 64 != 0 ? ~(~uint64_t(0) << (width % 64)) : ~uint64_t(0);
+        bits &= valid;
+        mask[word] = bits;
+        is_white = is_white && bits == valid;
+    }
+    return is_white;
+}
+
+} // namespace
+
+bool classify_row_scalar(const unsigned char *row, const unsigned int width, uint64_t *mask)
+{
+    const uint64_t all_white = ~uint64_t(0);
+    bool is_white = true;
+    unsigned int x = 0;
+    for (; x + 64 <= width; x += 64)
+    {
+        uint64_t bits = 0;
+        for (unsigned int byte = 0; byte < 64; byte += 8)
+        {
+            uint64_t chunk;
+            std::memcpy(&chunk, row + x + byte, 8);
+            if (chunk == all_white)
+            {// eight white pixels at once
+                bits |= uint64_t(0xff) << byte;
+                continue;
+            }
+            for (unsigned int it = 0; it < 8; ++it)
+            {
+                bits |= static_cast<uint64_t>(row[x + byte + it] == 0xff) << (byte + it);
+            }
+        }
+        mask[x / 64] = bits;
+        is_white = is_white && bits == all_white;
+    }
+    return classify_tail(row, x, width, mask) && is_white;
+}
+
+bool classify_row_mono1(const unsigned char *row, const unsigned int width, uint64_t *mask)
+{
+    return classify_mono1(row, width, mask, 0);
+}
+
+bool classify_row_mono1_inverted(const unsigned char *row, const unsigned int width, uint64_t *mask)
+{
+    return classify_mono1(row, width, mask, ~uint64_t(0));
+}
+
+bool classify_row_bgr24_scalar(const unsigned char *row, const unsigned int width, uint64_t *mask)
+{
+    const uint64_t all_white = ~uint64_t(0);
+    bool is_white = true;
+    unsigned int x = 0;
+    for (; x + 64 <= width; x += 64)
+    {
+        uint64_t bits = 0;
+        for (unsigned int group = 0; group < 64; group += 8)
+        {
+            const unsigned char *const pixels = row + 3 * static_cast<size_t>(x + group);
+            uint64_t chunks[3];
+            std::memcpy(chunks, pixels, sizeof(chunks));
+            if ((chunks[0] & chunks[1] & chunks[2]) == all_white)
+            {// eight white pixels at once
+                bits |= uint64_t(0xff) << group;
+                continue;
+            }
+            for (unsigned int it = 0; it < 8; ++it)
+            {
+                bits |= static_cast<uint64_t>(is_white_bgr(pixels + 3 * it)) << (group + it);
+            }
+        }
+        mask[x / 64] = bits;
+        is_white = is_white && bits == all_white;
+    }
+    return classify_tail_bgr24(row, x, width, mask) && is_white;
+}
+
+bool classify_row_bgra32_scalar(const unsigned char *row, const unsigned int width, uint64_t *mask)
+{
+    const uint64_t all_white = ~uint64_t(0);
+    bool is_white = true;
+    unsigned int x = 0;
+    for (; x + 64 <= width; x += 64)
+    {
+        uint64_t bits = 0;
+        for (unsigned int it = 0; it < 64; ++it)
+        {
+            uint32_t pixel;
+            std::memcpy(&pixel, row + 4 * static_cast<size_t>(x + it), 4);
+            bits |= static_cast<uint64_t>((pixel | 0xff000000u) == 0xffffffffu) << it;
+        }
+        mask[x / 64] = bits;
+        is_white = is_white && bits == all_white;
+    }
+    return classify_tail_bgra32(row, x, width, mask) && is_white;
+}
+
+bool classify_row_gray8_level_scalar(const unsigned char *row, const unsigned int width, const unsigned char level,
+                                     uint64_t *mask)
+{
+    return classify_level<Gray8Pixel>(row, width, level, mask);
+}
+
+bool classify_row_bgr24_level(const unsigned char *row, const unsigned int width, const unsigned char level,
+                              uint64_t *mask)
+{
+    return classify_level<Bgr24Pixel>(row, width, level, mask);
+}
+
+bool classify_row_bgra32_level(const unsigned char *row, const unsigned int width, const unsigned char level,
+                               uint64_t *mask)
+{
+    return classify_level<Bgra32Pixel>(row, width, level, mask);
+}
+
+#if defined(ROWSCAN_X86)
+
+ROWSCAN_TARGET("sse2")
+bool classify_row_sse2(const unsigned char *row, const unsigned int width, uint64_t *mask)
+{
+    const __m128i white = _mm_set1_epi8(static_cast<char>(0xff));
+    uint64_t all = ~uint64_t(0);
+    unsigned int x = 0;
+    for (; x + 64 <= width; x += 64)
+    {
+        const uint64_t m0 = static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(row + x)), white)));
+        const uint64_t m1 = static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(row + x + 16)), white)));
+        const uint64_t m2 = static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(row + x + 32)), white)));
+        const uint64_t m3 = static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(row + x + 48)), white)));
+        const uint64_t bits = m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+        mask[x / 64] = bits;
+        all &= bits;
+    }
+    return classify_tail(row, x, width, mask) && all == ~uint64_t(0);
+}
+
+ROWSCAN_TARGET("avx2")
+bool classify_row_avx2(const unsigned char *row, const unsigned int width, uint64_t *mask)
+{
+    const __m256i white = _mm256_set1_epi8(static_cast<char>(0xff));
+    uint64_t all = ~uint64_t(0);
+    unsigned int x = 0;
+    for (; x + 64 <= width; x += 64)
+    {
+        const uint64_t low = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(row + x)), white)));
+        const uint64_t high = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(row + x + 32)), white)));
+        const uint64_t bits = low | (high << 32);
+        mask[x / 64] = bits;
+        all &= bits;
+    }
+    return classify_tail(row, x, width, mask) && all == ~uint64_t(0);
+}
+
+// A byte reaches the level when the larger of the two is the byte itself.
+ROWSCAN_TARGET("sse2")
+bool classify_row_gray8_level_sse2(const unsigned char *row, const unsigned int width, const unsigned char level,
+                                   uint64_t *mask)
+{
+    const __m128i levels = _mm_set1_epi8(static_cast<char>(level));
+    uint64_t all = ~uint64_t(0);
+    unsigned int x = 0;
+    for (; x + 64 <= width; x += 64)
+    {
+        uint64_t bits = 0;
+        for (unsigned int it = 0; it < 64; it += 16)
+        {
+            const __m128i pixels = _mm_loadu_si128((const __m128i*)(row + x + it));
+            bits |= static_cast<uint64_t>(static_cast<uint16_t>(
+                        _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(pixels, levels), pixels)))) << it;
+        }
+        mask[x / 64] = bits;
+        all &= bits;
+    }
+    return classify_level_pixels<Gray8Pixel>(row, x, width, level, mask) && all == ~uint64_t(0);
+}
+
+// 16 pixels are three loads of 48 bytes. A pixel is white when its byte and the two after it
+// compare equal to 0xff, its bit is then picked out of the byte mask at every third position.
+ROWSCAN_TARGET("sse2")
+bool classify_row_bgr24_sse2(const unsigned char *row, const unsigned int width, uint64_t *mask)
+{
+    const __m128i white = _mm_set1_epi8(static_cast<char>(0xff));
+    uint64_t all = ~uint64_t(0);
+    unsigned int x = 0;
+    for (; x + 64 <= width; x += 64)
+    {
+        uint64_t bits = 0;
+        for (unsigned int it = 0; it < 64; it += 16)
+        {
+            const unsigned char *const pixels = row + 3 * static_cast<size_t>(x + it);
+            const uint64_t b0 = static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)pixels), white)));
+            const uint64_t b1 = static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(pixels + 16)), white)));
+            const uint64_t b2 = static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(pixels + 32)), white)));
+            const uint64_t bytes = b0 | (b1 << 16) | (b2 << 32);
+            bits |= every_third_bit(bytes & (bytes >> 1) & (bytes >> 2)) << it;
+        }
+        mask[x / 64] = bits;
+        all &= bits;
+    }
+    return classify_tail_bgr24(row, x, width, mask) && all == ~uint64_t(0);
+}
+
+// The alpha byte is forced to 0xff, then a white pixel is an all-ones 32-bit lane.
+ROWSCAN_TARGET("sse2")
+bool classify_row_bgra32_sse2(const unsigned char *row, const unsigned int width, uint64_t *mask)
+{
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xff000000u));
+    const __m128i white = _mm_set1_epi32(-1);
+    uint64_t all = ~uint64_t(0);
+    unsigned int x = 0;
+    for (; x + 64 <= width; x += 64)
+    {
+        uint64_t bits = 0;
+        for (unsigned int it = 0; it < 64; it += 4)
+        {
+            const __m128i pixels = _mm_or_si128(_mm_loadu_si128((const __m128i*)(row + 4 * static_cast<size_t>(x + it))), alpha);
+            bits |= static_cast<uint64_t>(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(pixels, white)))) << it;
+        }
+        mask[x / 64] = bits;
+        all &= bits;
+    }
+    return classify_tail_bgra32(row, x, width, mask) && all == ~uint64_t(0);
+}
+
+ROWSCAN_TARGET("avx2")
+bool classify_row_bgra32_avx2(const unsigned char *row, const unsigned int width, uint64_t *mask)
+{
+    const __m256i alpha = _mm256_set1_epi32(static_cast<int>(0xff000000u));
+    const __m256i white = _mm256_set1_epi32(-1);
+    uint64_t all = ~uint64_t(0);
+    unsigned int x = 0;
+    for (; x + 64 <= width; x += 64)
+    {
+        uint64_t bits = 0;
+        for (unsigned int it = 0; it < 64; it += 8)
+        {
+            const __m256i pixels = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(row + 4 * static_cast<size_t>(x + it))), alpha);
+            bits |= static_cast<uint64_t>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(pixels, white)))) << it;
+        }
+        mask[x / 64] = bits;
+        all &= bits;
+    }
+    return classify_tail_bgra32(row, x, width, mask) && all == ~uint64_t(0);
+}
+
+namespace
+{
+
+bool cpu_has_sse2()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    return true;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+bool cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+    {
+        return false;
+    }
+    __cpuid(info, 1);
+    const bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+    __cpuidex(info, 7, 0);
+    return os_saves_ymm && (info[1] & (1 << 5));
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+} // namespace
+
+SimdLevel simd_level()
+{
+    static const SimdLevel level = cpu_has_avx2() ? SimdLevel::Avx2 : cpu_has_sse2() ? SimdLevel::Sse2 : SimdLevel::Scalar;
+    return level;
+}
+
+#else
+
+bool classify_row_sse2(const unsigned char *row, const unsigned int width, uint64_t *mask)
+{
+    return classify_row_scalar(row, width, mask);
+}
+
+bool classify_row_avx2(const unsigned char *row, const unsigned int width, uint64_t *mask)
+{
+    return classify_row_scalar(row, width, mask);
+}
+
+SimdLevel simd_level()
+{
+    return SimdLevel::Scalar;
+}
+
+bool classify_row_bgr24_sse2(const unsigned char *row, const unsigned int width, uint64_t *mask)
+{
+    return classify_row_bgr24_scalar(row, width, mask);
+}
+
+bool classify_row_bgra32_sse2(const unsigned char *row, const unsigned int width, uint64_t *mask)
+{
+    return classify_row_bgra32_scalar(row, width, mask);
+}
+
+bool classify_row_bgra32_avx2(const unsigned char *row, const unsigned int width, uint64_t *mask)
+{
+    return classify_row_bgra32_scalar(row, width, mask);
+}
+
+bool classify_row_gray8_level_sse2(const unsigned char *row, const unsigned int width, const unsigned char level,
+                                   uint64_t *mask)
+{
+    return classify_row_gray8_level_scalar(row, width, level, mask);
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef ROWSCAN_H
+#define ROWSCAN_H
+
+#include "coder.h"
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// White mask of a row: bit (x % 64) of mask[x / 64] is set when pixel x is white (0xff).
+// The mask must hold row_mask_words(width) words, bits past the width are left cleared.
+inline unsigned int row_mask_words(const unsigned int width)
+{
+    return (width + 63) / 64;
+}
+
+// Fills the white mask of an 8-bit row and returns true when every pixel of the row is white.
+typedef bool (*ClassifyRowFunction)(const unsigned char *row, const unsigned int width, uint64_t *mask);
+
+bool classify_row_scalar(const unsigned char *row, const unsigned int width, uint64_t *mask);
+bool classify_row_sse2(const unsigned char *row, const unsigned int width, uint64_t *mask);
+bool classify_row_avx2(const unsigned char *row, const unsigned int width, uint64_t *mask);
+
+bool classify_row_mono1(const unsigned char *row, const unsigned int width, uint64_t *mask);
+bool classify_row_mono1_inverted(const unsigned char *row, const unsigned int width, uint64_t *mask);
+bool classify_row_bgr24_scalar(const unsigned char *row, const unsigned int width, uint64_t *mask);
+bool classify_row_bgr24_sse2(const unsigned char *row, const unsigned int width, uint64_t *mask);
+bool classify_row_bgra32_scalar(const unsigned char *row, const unsigned int width, uint64_t *mask);
+bool classify_row_bgra32_sse2(const unsigned char *row, const unsigned int width, uint64_t *mask);
+bool classify_row_bgra32_avx2(const unsigned char *row, const unsigned int width, uint64_t *mask);
+
+// Fills the white mask of a row whose white is any level at or above `level` and returns true
+// when every pixel of the row is white. A colour pixel is white when all of its channels are.
+typedef bool (*ClassifyLevelFunction)(const unsigned char *row, const unsigned int width, const unsigned char level,
+                                      uint64_t *mask);
+
+bool classify_row_gray8_level_scalar(const unsigned char *row, const unsigned int width, const unsigned char level,
+                                     uint64_t *mask);
+bool classify_row_gray8_level_sse2(const unsigned char *row, const unsigned int width, const unsigned char level,
+                                   uint64_t *mask);
+bool classify_row_bgr24_level(const unsigned char *row, const unsigned int width, const unsigned char level,
+                              uint64_t *mask);
+bool classify_row_bgra32_level(const unsigned char *row, const unsigned int width, const unsigned char level,
+                               uint64_t *mask);
+
+// Instruction sets the classifiers come in. The _sse2 and _avx2 ones only run on a CPU that
+// has them, elsewhere they are the scalar ones.
+enum class SimdLevel
+{
+    Scalar,
+    Sse2,
+    Avx2
+};
+
+// The best instruction set of the running CPU, detected once.
+SimdLevel simd_level();
+
+// Bytes taken by `width` pixels of `format`.
+inline size_t row_bytes(const unsigned int width, const PixelFormat format)
+{
+    switch (format)
+    {
+    case PixelFormat::Mono1 :
+    case PixelFormat::Mono1Inverted : return (static_cast<size_t>(width) + 7) / 8;
+    case PixelFormat::Bgr24 : return static_cast<size_t>(width) * 3;
+    case PixelFormat::Bgra32 : return static_cast<size_t>(width) * 4;
+    case PixelFormat::Gray8 : break;
+    }
+    return width;
+}
+
+// Position of the first pixel at or after pos whose color differs from white,
+// or width when the run lasts until the end of the row.
+inline unsigned int find_run_end(const uint64_t *mask, const unsigned int pos, const unsigned int width, const bool white)
+{
+    const uint64_t flip = white ? ~uint64_t(0) : 0;
+    const unsigned int words = row_mask_words(width);
+    unsigned int word = pos / 64;
+    uint64_t changes = (mask[word] ^ flip) & (~uint64_t(0) << (pos % 64));
+    while (changes == 0)
+    {
+        if (++word == words)
+        {
+            return width;
+        }
+        changes = mask[word] ^ flip;
+    }
+#if defined(_MSC_VER)
+    unsigned long bit = 0;
+    _BitScanForward64(&bit, changes);
+#else
+    const unsigned int bit = __builtin_ctzll(changes);
+#endif
+    const unsigned int end = word * 64 + bit;
+    return end < width ? end : width;
+}
+
+// Number of pixels whose mask bit differs from the one before, the bit before pixel 0 being
+// `first`; the runs of the row are one more. A whole mask word is counted at a time.
+inline unsigned int count_transitions(const uint64_t *mask, const unsigned int width, const bool first)
+{
+    const unsigned int words = row_mask_words(width);
+    uint64_t carry = first ? 1 : 0;
+    unsigned int count = 0;
+    for (unsigned int word = 0; word < words; ++word)
+    {
+        uint64_t changes = mask[word] ^ ((mask[word] << 1) | carry);
+        carry = mask[word] >> 63;
+        if (word + 1 == words && width % 64 != 0)
+        {
+            changes &= ~(~uint64_t(0) << (width % 64));
+        }
+#if defined(_MSC_VER)
+        count += static_cast<unsigned int>(__popcnt64(changes));
+#else
+        count += __builtin_popcountll(changes);
+#endif
+    }
+    return count;
+}
+
+#endif // ROWSCAN_H
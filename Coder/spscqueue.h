@@ -0,0 +1,132 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+// Bounded ring between exactly one producer and one consumer thread. Passing a value through
+// is two atomic stores, no lock is taken while the ring is neither full nor empty. A side
+// that has to wait spins for a moment and then sleeps until the other side moves.
+template <typename T, unsigned int Capacity>
+class SpscQueue
+{
+public:
+    SpscQueue()
+        : head(0)
+        , tail(0)
+        , sleepers(0)
+    {}
+
+    SpscQueue(const SpscQueue&) = delete;
+    void operator=(const SpscQueue&) = delete;
+
+    bool try_push(const T &value)
+    {
+        if (!put(value))
+        {
+            return false;
+        }
+        wake_up();
+        return true;
+    }
+
+    bool try_pop(T &value)
+    {
+        if (!take(value))
+        {
+            return false;
+        }
+        wake_up();
+        return true;
+    }
+
+    // Waits while the ring is full.
+    void push(const T &value)
+    {
+        wait_for([&]() { return put(value); });
+        wake_up();
+    }
+
+    // Waits while the ring is empty.
+    T pop()
+    {
+        T value;
+        wait_for([&]() { return take(value); });
+        wake_up();
+        return value;
+    }
+
+private:
+    bool put(const T &value)
+    {
+        const unsigned int at = tail.load(std::memory_order_relaxed);
+        if (at - head.load(std::memory_order_acquire) == Capacity)
+        {
+            return false;
+        }
+        slots[at % Capacity] = value;
+        tail.store(at + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool take(T &value)
+    {
+        const unsigned int at = head.load(std::memory_order_relaxed);
+        if (tail.load(std::memory_order_acquire) == at)
+        {
+            return false;
+        }
+        value = slots[at % Capacity];
+        slots[at % Capacity] = T();
+        head.store(at + 1, std::memory_order_release);
+        return true;
+    }
+
+    template <typename Attempt>
+    void wait_for(const Attempt &attempt)
+    {
+        for (unsigned int spin = 0; spin < 128; ++spin)
+        {
+            if (attempt())
+            {
+                return;
+            }
+        }
+        // both sides read-modify-write `sleepers`, so either the sleeper sees the other side's
+        // move or the other side sees the sleeper and wakes it once the lock is let go
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            sleepers.fetch_add(1);
+            const bool done = attempt();
+            if (!done)
+            {
+                wake.wait(lock);
+            }
+            sleepers.fetch_sub(1);
+            if (done)
+            {
+                return;
+            }
+        }
+    }
+
+    void wake_up()
+    {
+        if (sleepers.fetch_add(0) > 0)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            wake.notify_all();
+        }
+    }
+
+    std::atomic<unsigned int> head;
+    std::atomic<unsigned int> tail;
+    std::atomic<unsigned int> sleepers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    T slots[Capacity];
+};
+
+#endif // SPSCQUEUE_H
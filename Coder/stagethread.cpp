@@ -0,0 +1,64 @@
+#include "stagethread.h"
+
+StageThread::StageThread()
+    : job_function(nullptr)
+    , job_context(nullptr)
+    , outstanding(0)
+    , thread(&StageThread::work, this)
+{}
+
+StageThread::~StageThread()
+{
+    drain();
+    // a request without a job stops the thread
+    requests.push(Request{ nullptr, nullptr, 0 });
+    thread.join();
+}
+
+void StageThread::post(const unsigned int index)
+{
+    requests.push(Request{ job_function, job_context, index });
+    ++outstanding;
+}
+
+unsigned int StageThread::wait()
+{
+    const Completion completion = completions.pop();
+    --outstanding;
+    if (completion.error)
+    {
+        std::rethrow_exception(completion.error);
+    }
+    return completion.index;
+}
+
+void StageThread::drain()
+{
+    while (outstanding > 0)
+    {
+        completions.pop();
+        --outstanding;
+    }
+}
+
+void StageThread::work()
+{
+    for (;;)
+    {
+        const Request request = requests.pop();
+        if (!request.function)
+        {
+            return;
+        }
+        Completion completion{ request.index, nullptr };
+        try
+        {
+            request.function(request.context, request.index);
+        }
+        catch (...)
+        {
+            completion.error = std::current_exception();
+        }
+        completions.push(completion);
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef STAGETHREAD_H
+#define STAGETHREAD_H
+
+#include "spscqueue.h"
+
+#include <exception>
+#include <thread>
+
+// One stage of a pipeline on a thread of its own, such as the reads ahead of the encoder or
+// the writes behind it. The posting thread hands it indexes with post() and collects them
+// back, in the same order, with wait(); in between the stage runs job(index). Requests and
+// completions travel through SPSC queues, so a stage costs no locks while it keeps up.
+// At most `depth` indexes may be posted and not yet waited for.
+class StageThread
+{
+public:
+    static const unsigned int depth = 4;
+
+    StageThread();
+    ~StageThread();
+
+    StageThread(const StageThread&) = delete;
+    void operator=(const StageThread&) = delete;
+
+    // Sets the job run for the indexes posted from now on. Only allowed with nothing pending.
+    template <typename Job>
+    void start(Job &job)
+    {
+        job_function = &StageThread::invoke<Job>;
+        job_context = &job;
+    }
+
+    void post(const unsigned int index);
+
+    // Waits for the oldest pending index and returns it, rethrowing the exception its job threw.
+    unsigned int wait();
+
+    // Waits for every pending index, dropping their exceptions. Used to unwind a pipeline
+    // before the buffers its jobs work on go away.
+    void drain();
+
+    unsigned int pending() const { return outstanding; }
+
+private:
+    typedef void (*JobFunction)(void *job, const unsigned int index);
+
+    struct Request
+    {
+        JobFunction function;
+        void *context;
+        unsigned int index;
+    };
+
+    struct Completion
+    {
+        unsigned int index;
+        std::exception_ptr error;
+    };
+
+    template <typename Job>
+    static void invoke(void *job, const unsigned int index)
+    {
+        (*static_cast<Job*>(job))(index);
+    }
+
+    void work();
+
+    SpscQueue<Request, depth + 1> requests;
+    SpscQueue<Completion, depth> completions;
+    JobFunction job_function;
+    void *job_context;
+    unsigned int outstanding;
+    std::thread thread;
+};
+
+#endif // STAGETHREAD_H
@@ -0,0 +1,108 @@
+#include "workerpool.h"
+
+WorkerPool::WorkerPool(const unsigned int threads)
+    : generation(0)
+    , busy(0)
+    , stopping(false)
+    , next_index(0)
+    , job_count(0)
+    , job_function(nullptr)
+    , job_context(nullptr)
+{
+    for (unsigned int worker = 1; worker < threads; ++worker)
+    {
+        workers.emplace_back(&WorkerPool::work, this, worker);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &thread : workers)
+    {
+        thread.join();
+    }
+}
+
+void WorkerPool::run_erased(const unsigned int count, const JobFunction function, void *job)
+{
+    if (workers.empty() || count <= 1)
+    {
+        for (unsigned int index = 0; index < count; ++index)
+        {
+            function(job, index, 0);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job_count = count;
+        job_function = function;
+        job_context = job;
+        next_index = 0;
+        error = nullptr;
+        busy = static_cast<unsigned int>(workers.size());
+        ++generation;
+    }
+    wake.notify_all();
+    drain(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return busy == 0; });
+    job_function = nullptr;
+    job_context = nullptr;
+    if (error)
+    {
+        std::exception_ptr thrown = error;
+        error = nullptr;
+        std::rethrow_exception(thrown);
+    }
+}
+
+void WorkerPool::work(const unsigned int worker)
+{
+    unsigned int seen_generation = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]() { return stopping || generation != seen_generation; });
+            if (stopping)
+            {
+                return;
+            }
+            seen_generation = generation;
+        }
+        drain(worker);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            --busy;
+        }
+        done.notify_one();
+    }
+}
+
+void WorkerPool::drain(const unsigned int worker)
+{
+    try
+    {
+        for (unsigned int index = next_index++; index < job_count; index = next_index++)
+        {
+            job_function(job_context, index, worker);
+        }
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error)
+        {
+            error = std::current_exception();
+        }
+        next_index = job_count;
+    }
+}
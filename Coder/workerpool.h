@@ -0,0 +1,61 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads kept around for data-parallel loops. The calling thread takes part in every loop,
+// so a pool of size 1 starts no threads at all. Running a loop allocates nothing.
+class WorkerPool
+{
+public:
+    explicit WorkerPool(const unsigned int threads);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    void operator=(const WorkerPool&) = delete;
+
+    unsigned int size() const { return static_cast<unsigned int>(workers.size()) + 1; }
+
+    // Runs job(index, worker) for every index in [0, count), handing out the indexes in
+    // increasing order; worker in [0, size()) tells which thread runs it. Returns when all
+    // jobs are done, the first exception thrown by a job is rethrown here.
+    template <typename Job>
+    void run(const unsigned int count, Job &job)
+    {
+        run_erased(count, &WorkerPool::invoke<Job>, &job);
+    }
+
+private:
+    typedef void (*JobFunction)(void *job, const unsigned int index, const unsigned int worker);
+
+    template <typename Job>
+    static void invoke(void *job, const unsigned int index, const unsigned int worker)
+    {
+        (*static_cast<Job*>(job))(index, worker);
+    }
+
+    void run_erased(const unsigned int count, const JobFunction function, void *job);
+    void work(const unsigned int worker);
+    void drain(const unsigned int worker);
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    unsigned int generation;
+    unsigned int busy;
+    bool stopping;
+
+    std::atomic<unsigned int> next_index;
+    unsigned int job_count;
+    JobFunction job_function;
+    void *job_context;
+    std::exception_ptr error;
+};
+
+#endif // WORKERPOOL_H
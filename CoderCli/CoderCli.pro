@@ -0,0 +1,32 @@
+#-------------------------------------------------
+#
+# Headless batch driver for the Coder library
+#
+#-------------------------------------------------
+
+QT       = core
+QT       -= gui
+
+TARGET = barch
+TEMPLATE = app
+CONFIG += console c++11 thread
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+# qmake CONFIG+=sanitize builds with AddressSanitizer and UndefinedBehaviorSanitizer, for
+# running untrusted inputs through the coder; everything linked together needs the same setting.
+sanitize {
+    CONFIG += sanitizer sanitize_address sanitize_undefined
+}
+
+SOURCES += \
+        main.cpp
+
+unix|win32: LIBS += -L$$PWD/../ -lCoder
+
+INCLUDEPATH += $$PWD/../Coder
+DEPENDPATH += $$PWD/../Coder
+
+win32:!win32-g++: PRE_TARGETDEPS += $$PWD/../Coder.lib
+else:unix|win32-g++: PRE_TARGETDEPS += $$PWD/../libCoder.a
@@ -0,0 +1,480 @@
+#include "archive.h"
+#include "coder.h"
+#include "resultcache.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSet>
+#include <QStringList>
+#include <QTextStream>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+struct Job
+{
+    QString input;
+    QString output;
+    QString entry; // the archive entry packed to or unpacked from
+};
+
+// An input file and its name relative to the directory it was found in, the file name for a
+// file given by itself. Outputs and archive entries are named after the relative name, so
+// files of the same name in different subdirectories stay apart.
+struct Input
+{
+    QString path;
+    QString name;
+};
+
+bool isGlob(const QString &path)
+{
+    return path.contains('*') || path.contains('?') || path.contains('[');
+}
+
+// Expands files, directories and wildcard patterns (wildcards in the last path component only)
+// into the list of inputs, in a stable order.
+std::vector<Input> collectInputs(const QStringList &arguments, const QString &defaultFilter, const bool recursive,
+                                 QStringList &missing)
+{
+    std::vector<Input> inputs;
+    QSet<QString> seen;
+    auto add = [&](const QString &path, const QString &name)
+    {
+        if (!seen.contains(path))
+        {
+            seen.insert(path);
+            inputs.push_back({path, name});
+        }
+    };
+    const QDirIterator::IteratorFlags flags = recursive ? QDirIterator::Subdirectories
+                                                        : QDirIterator::NoIteratorFlags;
+    for (const QString &argument : arguments)
+    {
+        const QFileInfo info(argument);
+        QString directory;
+        QString filter;
+        if (isGlob(info.fileName()))
+        {
+            directory = info.path();
+            filter = info.fileName();
+        }
+        else if (info.isDir())
+        {
+            directory = info.filePath();
+            filter = defaultFilter;
+        }
+        else if (info.isFile())
+        {
+            add(info.filePath(), info.fileName());
+            continue;
+        }
+        else
+        {
+            missing << argument;
+            continue;
+        }
+
+        QStringList found;
+        QDirIterator it(directory, QStringList(filter), QDir::Files, flags);
+        while (it.hasNext())
+        {
+            found << it.next();
+        }
+        found.sort();
+        for (const QString &path : found)
+        {
+            add(path, QDir(directory).relativeFilePath(path));
+        }
+    }
+    return inputs;
+}
+
+// The path an entry is unpacked to, relative to the output directory: the entry's name, or
+// only its file name when the name would lead outside that directory.
+QString entryPath(const QString &name)
+{
+    const QString path = QDir::cleanPath(name);
+    if (QDir::isAbsolutePath(path) || path == ".." || path.startsWith("../"))
+    {
+        return QFileInfo(path).fileName();
+    }
+    return path;
+}
+
+QString outputName(const Input &input, const QString &outputDirectory, const QString &suffix)
+{
+    if (outputDirectory.isEmpty())
+    {
+        return input.path + suffix;
+    }
+    return QDir(outputDirectory).filePath(input.name + suffix);
+}
+
+QJsonObject stagesObject(const CoderStats &stats)
+{
+    QJsonObject stages;
+    stages["parse"] = stats.parse_seconds;
+    stages["load"] = stats.load_seconds;
+    stages["encode"] = stats.encode_seconds;
+    stages["decode"] = stats.decode_seconds;
+    stages["write"] = stats.write_seconds;
+    return stages;
+}
+
+QJsonObject rowsObject(const RowTypeCounts &rows)
+{
+    QJsonObject counts;
+    counts["empty"] = static_cast<qint64>(rows.empty);
+    counts["codes"] = static_cast<qint64>(rows.codes);
+    counts["runs"] = static_cast<qint64>(rows.runs);
+    counts["delta"] = static_cast<qint64>(rows.delta);
+    counts["bad"] = static_cast<qint64>(rows.bad);
+    return counts;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("barch");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Compresses 1, 8, 24 and 32-bit BMP files to .barch and back, one JSON line of stats per file.\n"
+                                     "pack and unpack keep many images in one archive, its first path; list prints its index.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("command", "compress, decompress, pack, unpack or list");
+    parser.addPositionalArgument("paths", "Files, directories or wildcard patterns; for unpack the names of the entries, all by default.", "paths...");
+    QCommandLineOption jobsOption({"j", "jobs"}, "Files processed in parallel, 0 for every core.", "n", "0");
+    QCommandLineOption threadsOption({"t", "threads"}, "Coder threads per file.", "n", "1");
+    QCommandLineOption recursiveOption({"r", "recursive"}, "Descend into subdirectories.");
+    QCommandLineOption outputOption({"o", "output"}, "Directory for the outputs, in the subdirectories of their inputs; next to the inputs by default.", "dir");
+    QCommandLineOption versionOption("format", "Container version written by compress, 1 or 2.", "version", "2");
+    QCommandLineOption statsOption("stats", "Write the JSON lines to a file instead of stdout.", "file");
+    QCommandLineOption outputFormatOption("output-format", "File written by decompress: bmp8, bmp1 or pbm.", "format", "bmp8");
+    QCommandLineOption cacheOption("cache", "Index of the outputs already written; files whose output is up to date are skipped.", "file");
+    QCommandLineOption whiteLevelOption("white-level", "Pixels at this level or above in every channel are compressed as white, 0 to 255.", "level", "255");
+    parser.addOptions({jobsOption, threadsOption, recursiveOption, outputOption, versionOption, statsOption,
+                       outputFormatOption, cacheOption, whiteLevelOption});
+    parser.process(app);
+
+    QTextStream err(stderr);
+    const QStringList positional = parser.positionalArguments();
+    const QString command = positional.value(0);
+    const bool packing = command == "pack";
+    const bool unpacking = command == "unpack";
+    const bool listing = command == "list";
+    const bool archiving = packing || unpacking || listing;
+    if (positional.size() < (packing ? 3 : 2)
+        || (command != "compress" && command != "decompress" && !archiving))
+    {
+        err << parser.helpText();
+        return 2;
+    }
+    const bool compressing = command == "compress" || packing;
+    const QString archiveName = archiving ? positional.value(1) : QString();
+
+    CoderOptions options;
+    options.threads = parser.value(threadsOption).toUInt();
+    options.version = parser.value(versionOption).toUInt();
+    if (options.version != 1 && options.version != 2)
+    {
+        err << "Unknown container version: " << parser.value(versionOption) << "\n";
+        return 2;
+    }
+    bool levelValid = false;
+    options.white_level = parser.value(whiteLevelOption).toUInt(&levelValid);
+    if (!levelValid || options.white_level > 0xff)
+    {
+        err << "Unknown white level: " << parser.value(whiteLevelOption) << "\n";
+        return 2;
+    }
+    const QString outputFormat = parser.value(outputFormatOption);
+    if (outputFormat == "bmp1")
+    {
+        options.output_format = OutputFormat::Bmp1;
+    }
+    else if (outputFormat == "pbm")
+    {
+        options.output_format = OutputFormat::Pbm;
+    }
+    else if (outputFormat != "bmp8")
+    {
+        err << "Unknown output format: " << outputFormat << "\n";
+        return 2;
+    }
+    if (parser.isSet(cacheOption))
+    {
+        options.cache = std::make_shared<ResultCache>(QFile::encodeName(parser.value(cacheOption)).toStdString());
+    }
+    const QString suffix = compressing ? ".barch" : outputFormat == "pbm" ? ".pbm" : ".bmp";
+    const QString outputDirectory = parser.value(outputOption);
+    if (!outputDirectory.isEmpty() && !QDir().mkpath(outputDirectory))
+    {
+        err << "Can't create the output directory: " << outputDirectory << "\n";
+        return 2;
+    }
+
+    QFile stats;
+    if (parser.isSet(statsOption))
+    {
+        stats.setFileName(parser.value(statsOption));
+    }
+    if (!(stats.fileName().isEmpty() ? stats.open(stdout, QIODevice::WriteOnly)
+                                     : stats.open(QIODevice::WriteOnly | QIODevice::Truncate)))
+    {
+        err << "Can't open the stats file: " << parser.value(statsOption) << "\n";
+        return 2;
+    }
+
+    // pack writes one archive, unpack and list read one
+    std::unique_ptr<ArchiveWriter> archiveWriter;
+    std::unique_ptr<ArchiveReader> archiveReader;
+    try
+    {
+        if (packing)
+        {
+            archiveWriter.reset(new ArchiveWriter(QFile::encodeName(archiveName).toStdString(), options));
+        }
+        else if (archiving)
+        {
+            archiveReader.reset(new ArchiveReader(QFile::encodeName(archiveName).toStdString(), options.map_files));
+        }
+    }
+    catch (const std::exception &e)
+    {
+        err << archiveName << ": " << QString::fromLocal8Bit(e.what()) << "\n";
+        return 1;
+    }
+    if (listing)
+    {
+        for (const ArchiveEntry &entry : archiveReader->entries())
+        {
+            QJsonObject line;
+            line["name"] = QString::fromStdString(entry.name);
+            line["width"] = static_cast<qint64>(entry.width);
+            line["height"] = static_cast<qint64>(entry.height);
+            line["offset"] = static_cast<qint64>(entry.offset);
+            line["bytes"] = static_cast<qint64>(entry.size);
+            stats.write(QJsonDocument(line).toJson(QJsonDocument::Compact) + '\n');
+        }
+        return 0;
+    }
+
+    QStringList missing;
+    std::vector<Input> inputs;
+    if (unpacking)
+    {
+        // entries are taken by name, the paths are not files here
+        const QStringList names = positional.mid(2);
+        for (const QString &name : names)
+        {
+            if (archiveReader->find(name.toStdString()) < 0)
+            {
+                missing << name;
+            }
+            else
+            {
+                inputs.push_back({name, entryPath(name)});
+            }
+        }
+        if (names.isEmpty())
+        {
+            for (const ArchiveEntry &entry : archiveReader->entries())
+            {
+                const QString name = QString::fromStdString(entry.name);
+                inputs.push_back({name, entryPath(name)});
+            }
+        }
+    }
+    else
+    {
+        inputs = collectInputs(positional.mid(packing ? 2 : 1), compressing ? "*.bmp" : "*.barch",
+                               parser.isSet(recursiveOption), missing);
+    }
+    for (const QString &path : missing)
+    {
+        err << "No such file or directory: " << path << "\n";
+    }
+
+    std::vector<Job> jobs;
+    for (const Input &input : inputs)
+    {
+        // unpacked files are named after their entry, under the current directory without -o
+        jobs.push_back({input.path, packing ? archiveName + ":" + input.name
+                                            : unpacking ? outputName({input.name, input.name}, outputDirectory, suffix)
+                                                        : outputName(input, outputDirectory, suffix),
+                        packing ? input.name : unpacking ? input.path : QString()});
+    }
+    if (jobs.empty())
+    {
+        err << "No input files.\n";
+        return 1;
+    }
+    // two inputs must not end up in the same output or entry, that is caught before any is coded
+    QHash<QString, QString> written;
+    for (const Job &job : jobs)
+    {
+        const QString output = packing ? job.entry : QDir::cleanPath(QFileInfo(job.output).absoluteFilePath());
+        if (written.contains(output))
+        {
+            err << "Both " << written[output] << " and " << job.input << " would be written to " << job.output << "\n";
+            return 2;
+        }
+        written.insert(output, job.input);
+    }
+    if (!packing)
+    {
+        for (const Job &job : jobs)
+        {
+            const QString directory = QFileInfo(job.output).path();
+            if (!QDir().mkpath(directory))
+            {
+                err << "Can't create the output directory: " << directory << "\n";
+                return 2;
+            }
+        }
+    }
+
+    unsigned int workers = parser.value(jobsOption).toUInt();
+    if (workers == 0)
+    {
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    workers = std::min<unsigned int>(workers, static_cast<unsigned int>(jobs.size()));
+
+    std::atomic<size_t> next(0);
+    std::atomic<int> failed(static_cast<int>(missing.size()));
+    std::mutex statsMutex;
+    auto work = [&]()
+    {
+        // one context per worker, its buffers are reused from file to file
+        Encoder encoder(options);
+        Decoder decoder(options);
+        for (size_t it = next++; it < jobs.size(); it = next++)
+        {
+            const Job &job = jobs[it];
+            QJsonObject line;
+            line["input"] = job.input;
+            line["output"] = job.output;
+            const auto start = std::chrono::steady_clock::now();
+            bool ok = true;
+            qint64 inputBytes = 0;
+            qint64 outputBytes = 0;
+            try
+            {
+                if (packing)
+                {
+                    const ArchiveEntry entry = archiveWriter->add_file(job.entry.toStdString(), QFile::encodeName(job.input).toStdString());
+                    outputBytes = static_cast<qint64>(entry.size);
+                }
+                else if (unpacking)
+                {
+                    const ArchiveEntry &entry = archiveReader->entries()[archiveReader->find(job.entry.toStdString())];
+                    archiveReader->extract(entry, QFile::encodeName(job.output).toStdString(), decoder);
+                    inputBytes = static_cast<qint64>(entry.size);
+                }
+                else if (compressing)
+                {
+                    encoder.compress(QFile::encodeName(job.input).toStdString(), QFile::encodeName(job.output).toStdString());
+                }
+                else
+                {
+                    decoder.decompress(QFile::encodeName(job.input).toStdString(), QFile::encodeName(job.output).toStdString());
+                }
+            }
+            catch (const std::exception &e)
+            {
+                ok = false;
+                line["error"] = QString::fromLocal8Bit(e.what());
+                ++failed;
+            }
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (!unpacking)
+            {
+                inputBytes = QFileInfo(job.input).size();
+            }
+            if (!packing)
+            {
+                outputBytes = ok ? QFileInfo(job.output).size() : 0;
+            }
+            line["ok"] = ok;
+            line["input_bytes"] = inputBytes;
+            line["output_bytes"] = outputBytes;
+            line["seconds"] = elapsed.count();
+            line["ratio"] = outputBytes > 0 ? static_cast<double>(inputBytes) / outputBytes : 0.0;
+            if (ok && !packing)
+            {
+                line["cached"] = (compressing ? encoder.stats() : decoder.stats()).cached;
+                line["stages"] = stagesObject(compressing ? encoder.stats() : decoder.stats());
+                line["rows"] = rowsObject((compressing ? encoder.stats() : decoder.stats()).rows);
+            }
+
+            const QByteArray text = QJsonDocument(line).toJson(QJsonDocument::Compact) + '\n';
+            std::lock_guard<std::mutex> lock(statsMutex);
+            stats.write(text);
+            stats.flush();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int it = 1; it < workers; ++it)
+    {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    if (archiveWriter)
+    {
+        try
+        {
+            archiveWriter->finish();
+        }
+        catch (const std::exception &e)
+        {
+            err << archiveName << ": " << QString::fromLocal8Bit(e.what()) << "\n";
+            return 1;
+        }
+    }
+
+    if (options.cache)
+    {
+        try
+        {
+            options.cache->save();
+        }
+        catch (const std::exception &e)
+        {
+            err << e.what() << "\n";
+        }
+        err << "cache: " << options.cache->hits() << " up to date, " << options.cache->misses() << " coded" << "\n";
+    }
+
+    if (failed > 0)
+    {
+        err << failed.load() << " of " << static_cast<int>(jobs.size()) + missing.size() << " file(s) failed" << "\n";
+        return 1;
+    }
+    return 0;
+}
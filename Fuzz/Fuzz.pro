@@ -0,0 +1,30 @@
+#-------------------------------------------------
+#
+# libFuzzer target for the .barch and archive decoders
+#
+#-------------------------------------------------
+
+QT       -= core gui
+
+TARGET = fuzz_decode
+TEMPLATE = app
+CONFIG += console c++11 thread
+CONFIG -= app_bundle qt
+
+# libFuzzer comes with clang, so this is built with qmake -spec linux-clang. The Coder sources
+# are compiled in here rather than taken from libCoder.a, the fuzzer needs their coverage.
+QMAKE_CXXFLAGS += -fsanitize=fuzzer,address,undefined
+QMAKE_LFLAGS += -fsanitize=fuzzer,address,undefined
+
+SOURCES += \
+        fuzz_decode.cpp \
+        $$PWD/../Coder/archive.cpp \
+        $$PWD/../Coder/coder.cpp \
+        $$PWD/../Coder/mappedfile.cpp \
+        $$PWD/../Coder/resultcache.cpp \
+        $$PWD/../Coder/rowscan.cpp \
+        $$PWD/../Coder/stagethread.cpp \
+        $$PWD/../Coder/workerpool.cpp
+
+INCLUDEPATH += $$PWD/../Coder
+DEPENDPATH += $$PWD/../Coder
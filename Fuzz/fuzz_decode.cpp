@@ -0,0 +1,130 @@
+#include "archive.h"
+#include "coder.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+namespace
+{
+
+// A file of this process in TMPDIR, or /tmp without one, so runs in parallel keep apart and the
+// working directory stays clean.
+std::string temp_name(const char *suffix)
+{
+    const char *const directory = std::getenv("TMPDIR");
+    return std::string(directory && *directory ? directory : "/tmp") + "/fuzz_decode." + std::to_string(getpid())
+           + suffix;
+}
+
+// Decodes an image and a few previews of it, a broken image may throw but nothing else.
+void decode(const unsigned char *data, const size_t size, const CoderOptions &options)
+{
+    std::vector<unsigned char> pixels;
+    try
+    {
+        decompress_buffer(data, size, pixels, options);
+    }
+    catch (const std::exception &)
+    {}
+    const PreviewRegion regions[] = { { 0, 0xffffffffu, 1, 1 }, { 5, 40, 4, 2 }, { 1, 0xffffffffu, 8, 8 } };
+    for (const PreviewRegion &region : regions)
+    {
+        try
+        {
+            decompress_preview(data, size, region, pixels, options);
+        }
+        catch (const std::exception &)
+        {}
+    }
+}
+
+// The file calls on the input: decompress() to every output format, mapped with the bands
+// prefetched and through the stream, and decompress_rows() on ranges within and across bands.
+void decode_file(const std::string &file_name, const std::string &out_name, CoderOptions options)
+{
+    for (const bool mapping : { true, false })
+    {
+        options.map_files = mapping;
+        for (const OutputFormat format : { OutputFormat::Bmp8, OutputFormat::Bmp1, OutputFormat::Pbm })
+        {
+            options.output_format = format;
+            try
+            {
+                decompress(file_name, out_name, options);
+            }
+            catch (const std::exception &)
+            {}
+        }
+    }
+    const unsigned int ranges[][2] = { { 0, 1 }, { 60, 10 }, { 1, 0xffffffffu } };
+    std::vector<unsigned char> pixels;
+    for (const auto &range : ranges)
+    {
+        try
+        {
+            decompress_rows(file_name, range[0], range[1], pixels, options);
+        }
+        catch (const std::exception &)
+        {}
+    }
+}
+
+// The input as an archive, read mapped and through the stream. Every entry it lists is read
+// and decoded in memory, and extracted to a file.
+void read_archive(const std::string &file_name, const std::string &out_name, const CoderOptions &options)
+{
+    std::vector<unsigned char> image;
+    Decoder decoder(options);
+    for (const bool mapping : { true, false })
+    {
+        try
+        {
+            const ArchiveReader reader(file_name, mapping);
+            for (const ArchiveEntry &entry : reader.entries())
+            {
+                reader.read(entry, image);
+                decode(image.data(), image.size(), options);
+                try
+                {
+                    reader.extract(entry, out_name, decoder);
+                }
+                catch (const std::exception &)
+                {}
+            }
+        }
+        catch (const std::exception &)
+        {}
+    }
+}
+
+} // namespace
+
+// Runs every input through decompress_buffer(), decompress_preview(), the file decoders and
+// ArchiveReader. The decoders refuse images of over a megapixel, which keeps each run fast and
+// well inside libFuzzer's memory limit while a forged size still gets checked.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    CoderOptions options;
+    options.max_pixels = 1 << 20;
+    decode(data, size, options);
+
+    // the file calls only open files, so the input goes to one of this process's own first
+    const std::string file_name = temp_name(".in");
+    const std::string out_name = temp_name(".out");
+    {
+        std::ofstream out(file_name, std::ios_base::binary | std::ios_base::trunc);
+        out.write((const char*)data, size);
+    }
+    decode_file(file_name, out_name, options);
+    read_archive(file_name, out_name, options);
+    std::remove(file_name.c_str());
+    std::remove(out_name.c_str());
+    return 0;
+}
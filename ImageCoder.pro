@@ -1,43 +1,52 @@
-QT += quick
-QT += qml
-
-CONFIG += c++11
-
-# The following define makes your compiler emit warnings if you use
-# any feature of Qt which as been marked deprecated (the exact warnings
-# depend on your compiler). Please consult the documentation of the
-# deprecated API in order to know how to port your code away from it.
-DEFINES += QT_DEPRECATED_WARNINGS
-
-# You can also make your code fail to compile if you use deprecated APIs.
-# In order to do so, uncomment the following line.
-# You can also select to disable deprecated APIs only up to a certain version of Qt.
-#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
-
-SOURCES += \
-        main.cpp \
-    filesmodel.cpp
-
-RESOURCES += qml.qrc
-
-# Additional import path used to resolve QML modules in Qt Creator's code model
-QML_IMPORT_PATH =
-
-# Additional import path used to resolve QML modules just for Qt Quick Designer
-QML_DESIGNER_IMPORT_PATH =
-
-# Default rules for deployment.
-qnx: target.path = /tmp/$${TARGET}/bin
-else: unix:!android: target.path = /opt/$${TARGET}/bin
-!isEmpty(target.path): INSTALLS += target
-
-HEADERS += \
-    filesmodel.h
-
-unix|win32: LIBS += -L$$PWD/./ -lCoder
-
-INCLUDEPATH += $$PWD/Coder
-DEPENDPATH += $$PWD/Coder
-
-win32:!win32-g++: PRE_TARGETDEPS += $$PWD/./Coder.lib
-else:unix|win32-g++: PRE_TARGETDEPS += $$PWD/./libCoder.a
+QT += quick
+QT += qml
+
+CONFIG += c++11
+
+# The following define makes your compiler emit warnings if you use
+# any feature of Qt which as been marked deprecated (the exact warnings
+# depend on your compiler). Please consult the documentation of the
+# deprecated API in order to know how to port your code away from it.
+DEFINES += QT_DEPRECATED_WARNINGS
+
+# You can also make your code fail to compile if you use deprecated APIs.
+# In order to do so, uncomment the following line.
+# You can also select to disable deprecated APIs only up to a certain version of Qt.
+#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
+
+SOURCES += \
+        main.cpp \
+    filesmodel.cpp \
+    previewprovider.cpp
+
+RESOURCES += qml.qrc
+
+# Additional import path used to resolve QML modules in Qt Creator's code model
+QML_IMPORT_PATH =
+
+# Additional import path used to resolve QML modules just for Qt Quick Designer
+QML_DESIGNER_IMPORT_PATH =
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
+
+HEADERS += \
+    filesmodel.h \
+    previewprovider.h
+
+unix|win32: LIBS += -L$$PWD/./ -lCoder
+
+INCLUDEPATH += $$PWD/Coder
+DEPENDPATH += $$PWD/Coder
+
+win32:!win32-g++: PRE_TARGETDEPS += $$PWD/./Coder.lib
+else:unix|win32-g++: PRE_TARGETDEPS += $$PWD/./libCoder.a
+
+# make fuzz builds Fuzz/, the libFuzzer target for the decoders, with clang next to this build.
+linux {
+    fuzz.commands = $(MKDIR) $$OUT_PWD/Fuzz && cd $$OUT_PWD/Fuzz \
+                    && $(QMAKE) -spec linux-clang $$PWD/Fuzz/Fuzz.pro && $(MAKE)
+    QMAKE_EXTRA_TARGETS += fuzz
+}
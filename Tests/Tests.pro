@@ -0,0 +1,27 @@
+#-------------------------------------------------
+#
+# Regression tests for the Coder library, make check runs them
+#
+#-------------------------------------------------
+
+QT       -= core gui
+
+TARGET = codertests
+TEMPLATE = app
+CONFIG += console c++11 thread testcase
+CONFIG -= app_bundle qt
+
+SOURCES += \
+        allocations.cpp \
+        tests.cpp
+
+HEADERS += \
+        allocations.h
+
+unix|win32: LIBS += -L$$PWD/../ -lCoder
+
+INCLUDEPATH += $$PWD/../Coder
+DEPENDPATH += $$PWD/../Coder
+
+win32:!win32-g++: PRE_TARGETDEPS += $$PWD/../Coder.lib
+else:unix|win32-g++: PRE_TARGETDEPS += $$PWD/../libCoder.a
@@ -0,0 +1,8 @@
+#ifndef ALLOCATIONS_H
+#define ALLOCATIONS_H
+
+// Heap allocations made by the whole process so far, from any thread. operator new is
+// replaced in allocations.cpp to count them.
+unsigned long long allocation_count();
+
+#endif // ALLOCATIONS_H
@@ -0,0 +1,970 @@
+#include "allocations.h"
+#include "archive.h"
+#include "coder.h"
+#include "resultcache.h"
+#include "rowscan.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+int failures = 0;
+
+void check(const bool condition, const std::string &what)
+{
+    if (!condition)
+    {
+        std::printf("FAIL: %s\n", what.c_str());
+        ++failures;
+    }
+}
+
+// One 8-bit image, rows are `width` bytes apart.
+struct Image
+{
+    unsigned int width;
+    unsigned int height;
+    std::vector<unsigned char> pixels;
+
+    PixelSpan span() const
+    {
+        return { pixels.data(), width, height, width, PixelFormat::Gray8 };
+    }
+};
+
+typedef unsigned char (*Pattern)(unsigned int x, unsigned int y);
+
+unsigned char checker(const unsigned int x, const unsigned int y)
+{
+    return (x / 4 + y / 4) % 2 ? 0x00 : 0xff;
+}
+
+// squares of 4 around the corner, the inner ones white
+unsigned char frame(const unsigned int x, const unsigned int y)
+{
+    return (std::min(x, y) / 4) % 2 ? 0x00 : 0xff;
+}
+
+// every row one black run, so its last group is the 1-3 pixel tail for most widths
+unsigned char black(const unsigned int, const unsigned int)
+{
+    return 0x00;
+}
+
+unsigned char noise(const unsigned int x, const unsigned int y)
+{
+    uint32_t seed = x * 2654435761u ^ y * 40503u;
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 1 ? 0x00 : 0xff;
+}
+
+Image make_image(const unsigned int width, const unsigned int height, const Pattern pattern)
+{
+    Image image{ width, height, std::vector<unsigned char>(static_cast<size_t>(width) * height) };
+    for (unsigned int y = 0; y < height; ++y)
+    {
+        for (unsigned int x = 0; x < width; ++x)
+        {
+            image.pixels[static_cast<size_t>(y) * width + x] = pattern(x, y);
+        }
+    }
+    return image;
+}
+
+std::string describe(const char *name, const Image &image, const CoderOptions &options)
+{
+    return std::string(name) + " " + std::to_string(image.width) + "x" + std::to_string(image.height)
+           + " v" + std::to_string(options.version) + (options.row_modes ? "" : " codes");
+}
+
+// Square images that are symmetric about the diagonal, with runs of whole groups and no fully
+// white rows, come out of the encoder byte for byte as they did before it walked rows in memory
+// order. The frame has white rows, stored with a zero size since then.
+void test_known_bytes()
+{
+    static const unsigned char checker8[] = {
+        0x08, 0x00, 0x08, 0x00, 0x01, 0x00, 0x02, 0x01, 0x00, 0x02, 0x01, 0x00, 0x02, 0x01, 0x00, 0x02,
+        0x01, 0x00, 0x01, 0x01, 0x00, 0x01, 0x01, 0x00, 0x01, 0x01, 0x00, 0x01
+    };
+    static const unsigned char checker16[] = {
+        0x10, 0x00, 0x10, 0x00, 0x01, 0x00, 0x12, 0x01, 0x00, 0x12, 0x01, 0x00, 0x12, 0x01, 0x00, 0x12,
+        0x01, 0x00, 0x09, 0x01, 0x00, 0x09, 0x01, 0x00, 0x09, 0x01, 0x00, 0x09, 0x01, 0x00, 0x12, 0x01,
+        0x00, 0x12, 0x01, 0x00, 0x12, 0x01, 0x00, 0x12, 0x01, 0x00, 0x09, 0x01, 0x00, 0x09, 0x01, 0x00,
+        0x09, 0x01, 0x00, 0x09
+    };
+    static const unsigned char frame16[] = {
+        0x10, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x2a, 0x01,
+        0x00, 0x2a, 0x01, 0x00, 0x2a, 0x01, 0x00, 0x2a, 0x01, 0x00, 0x02, 0x01, 0x00, 0x02, 0x01, 0x00,
+        0x02, 0x01, 0x00, 0x02, 0x01, 0x00, 0x12, 0x01, 0x00, 0x12, 0x01, 0x00, 0x12, 0x01, 0x00, 0x12
+    };
+    const struct
+    {
+        const char *name;
+        unsigned int side;
+        Pattern pattern;
+        const unsigned char *bytes;
+        size_t size;
+    } cases[] = {
+        { "checker", 8, checker, checker8, sizeof(checker8) },
+        { "checker", 16, checker, checker16, sizeof(checker16) },
+        { "frame", 16, frame, frame16, sizeof(frame16) }
+    };
+
+    CoderOptions options;
+    options.version = 1;
+    for (const auto &known : cases)
+    {
+        const Image image = make_image(known.side, known.side, known.pattern);
+        std::vector<unsigned char> archive;
+        compress_buffer(image.span(), archive, options);
+        check(archive == std::vector<unsigned char>(known.bytes, known.bytes + known.size),
+              describe(known.name, image, options) + ": encoded bytes changed");
+    }
+}
+
+void round_trip(const char *name, const Image &image, const CoderOptions &options)
+{
+    const std::string what = describe(name, image, options);
+    try
+    {
+        std::vector<unsigned char> archive;
+        std::vector<unsigned char> pixels;
+        compress_buffer(image.span(), archive, options);
+        const BarchInfo info = decompress_buffer(archive.data(), archive.size(), pixels, options);
+        check(info.width == image.width && info.height == image.height, what + ": wrong size");
+        check(pixels == image.pixels, what + ": pixels differ after decoding");
+    }
+    catch (const std::exception &error)
+    {
+        check(false, what + ": " + error.what());
+    }
+}
+
+// Non-square images, every width around a group of 4 pixels, in both containers and with and
+// without the row modes.
+void test_round_trips()
+{
+    const unsigned int sizes[][2] = {
+        { 1, 1 }, { 2, 7 }, { 3, 5 }, { 5, 3 }, { 6, 1 }, { 7, 2 }, { 9, 70 }, { 70, 9 }, { 129, 66 }, { 4, 130 }
+    };
+    const struct
+    {
+        const char *name;
+        Pattern pattern;
+    } patterns[] = { { "checker", checker }, { "frame", frame }, { "black", black }, { "noise", noise } };
+
+    for (unsigned int version = 1; version <= 2; ++version)
+    {
+        for (const bool row_modes : { true, false })
+        {
+            CoderOptions options;
+            options.version = version;
+            options.row_modes = row_modes;
+            for (const auto &size : sizes)
+            {
+                for (const auto &pattern : patterns)
+                {
+                    round_trip(pattern.name, make_image(size[0], size[1], pattern.pattern), options);
+                }
+            }
+        }
+    }
+}
+
+// A run that ends the row 1-3 pixels into a group used to be dropped and decoded as white.
+void test_tails()
+{
+    CoderOptions options;
+    options.version = 1;
+    for (unsigned int width = 1; width <= 11; ++width)
+    {
+        const Image image = make_image(width, 1, black);
+        std::vector<unsigned char> archive;
+        std::vector<unsigned char> pixels;
+        compress_buffer(image.span(), archive, options);
+        decompress_buffer(archive.data(), archive.size(), pixels, options);
+        check(pixels == image.pixels, "black row of " + std::to_string(width) + ": tail decoded as white");
+    }
+}
+
+// The 16-bit width and height of a v1 image 21058 x 18499 are the bytes of the v2 magic.
+void test_v1_magic()
+{
+    const uint16_t width = 21058;
+    const uint16_t height = 18499;
+    std::vector<unsigned char> archive(4 + 2 * static_cast<size_t>(height)); // every row white
+    std::memcpy(archive.data(), &width, 2);
+    std::memcpy(archive.data() + 2, &height, 2);
+    try
+    {
+        const BarchInfo info = read_barch_info(archive.data(), archive.size());
+        check(info.version == 1 && info.width == width && info.height == height, "v1 image read as v2");
+    }
+    catch (const std::exception &error)
+    {
+        check(false, std::string("v1 image with the v2 magic: ") + error.what());
+    }
+}
+
+// Rows wider than 65535 pixels have v2 store their sizes as varints, the rows here encode to
+// more than 64 KB each. v1 only has 16-bit dimensions and refuses them.
+void test_wide_rows()
+{
+    const Image image = make_image(300000, 3, noise);
+    for (const bool row_modes : { true, false })
+    {
+        CoderOptions options;
+        options.row_modes = row_modes;
+        round_trip("noise", image, options);
+        std::vector<unsigned char> archive;
+        compress_buffer(image.span(), archive, options);
+        check(archive.size() > image.height * size_t(0x10000), describe("noise", image, options) + ": rows under 64 KB");
+    }
+    CoderOptions options;
+    options.version = 1;
+    std::vector<unsigned char> archive;
+    try
+    {
+        compress_buffer(image.span(), archive, options);
+        check(false, describe("noise", image, options) + ": written in v1");
+    }
+    catch (const std::runtime_error &)
+    {
+    }
+}
+
+// Warm Encoder and Decoder contexts code a stream of same-sized images from memory without
+// touching the heap, on one thread and on several.
+void test_warm_contexts()
+{
+    const Image images[] = { make_image(300, 200, noise), make_image(300, 200, frame), make_image(300, 200, checker) };
+    for (const unsigned int threads : { 1u, 4u })
+    {
+        CoderOptions options;
+        options.threads = threads;
+        Encoder encoder(options);
+        Decoder decoder(options);
+        std::vector<unsigned char> archive;
+        std::vector<unsigned char> pixels(static_cast<size_t>(images[0].width) * images[0].height);
+        BarchInfo info;
+        // the first image sizes the arenas
+        compress_buffer(images[0].span(), archive, options);
+        encoder.compress(images[0].span());
+        decoder.decompress(archive.data(), archive.size(), info);
+
+        const std::string what = std::to_string(threads) + " thread(s)";
+        for (const Image &image : images)
+        {
+            compress_buffer(image.span(), archive, options);
+            unsigned long long before = allocation_count();
+            const std::vector<unsigned char> &encoded = encoder.compress(image.span());
+            const unsigned long long encoder_allocations = allocation_count() - before;
+            check(encoder_allocations == 0, "warm Encoder::compress() allocates, " + what);
+            check(encoded == archive, "Encoder::compress() differs from compress_buffer(), " + what);
+
+            before = allocation_count();
+            const std::vector<unsigned char> &decoded = decoder.decompress(archive.data(), archive.size(), info);
+            const unsigned long long decoder_allocations = allocation_count() - before;
+            check(decoder_allocations == 0, "warm Decoder::decompress() allocates, " + what);
+            check(decoded == image.pixels, "Decoder::decompress() pixels differ, " + what);
+
+            before = allocation_count();
+            decoder.decompress(archive.data(), archive.size(), pixels.data(), image.width, pixels.size());
+            const unsigned long long buffer_allocations = allocation_count() - before;
+            check(buffer_allocations == 0, "warm Decoder::decompress() into a buffer allocates, " + what);
+            check(pixels == image.pixels, "Decoder::decompress() into a buffer pixels differ, " + what);
+        }
+    }
+}
+
+// 24-bit rows, mostly white with a channel off here and there, are classified alike by every
+// classifier and come back from the coder as their white mask.
+void test_bgr24()
+{
+    for (const unsigned int width : { 1u, 15u, 16u, 63u, 64u, 65u, 130u, 1000u })
+    {
+        std::vector<unsigned char> row(3 * static_cast<size_t>(width));
+        std::vector<unsigned char> expected(width);
+        uint32_t seed = width;
+        for (unsigned int x = 0; x < width; ++x)
+        {
+            for (unsigned int channel = 0; channel < 3; ++channel)
+            {
+                seed = seed * 1103515245 + 12345;
+                row[3 * x + channel] = (seed >> 16) % 8 == 0 ? static_cast<unsigned char>(seed >> 24) & 0xfe : 0xff;
+            }
+            expected[x] = row[3 * x] == 0xff && row[3 * x + 1] == 0xff && row[3 * x + 2] == 0xff ? 0xff : 0x00;
+        }
+
+        const std::string what = "bgr24 row of " + std::to_string(width);
+        std::vector<uint64_t> scalar_mask(row_mask_words(width));
+        std::vector<uint64_t> sse2_mask(row_mask_words(width));
+        const bool scalar_white = classify_row_bgr24_scalar(row.data(), width, scalar_mask.data());
+        const bool sse2_white = classify_row_bgr24_sse2(row.data(), width, sse2_mask.data());
+        check(scalar_mask == sse2_mask && scalar_white == sse2_white, what + ": classifiers differ");
+
+        const PixelSpan span = { row.data(), width, 1, row.size(), PixelFormat::Bgr24 };
+        std::vector<unsigned char> archive;
+        std::vector<unsigned char> pixels;
+        compress_buffer(span, archive);
+        decompress_buffer(archive.data(), archive.size(), pixels);
+        check(pixels == expected, what + ": pixels differ after decoding");
+    }
+}
+
+bool write_file(const std::string &file_name, const std::vector<unsigned char> &bytes)
+{
+    FILE *const file = std::fopen(file_name.c_str(), "wb");
+    const bool written = file && std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    return file && std::fclose(file) == 0 && written;
+}
+
+std::vector<unsigned char> read_file(const std::string &file_name)
+{
+    std::vector<unsigned char> bytes;
+    FILE *const file = std::fopen(file_name.c_str(), "rb");
+    if (file)
+    {
+        unsigned char chunk[4096];
+        size_t size = 0;
+        while ((size = std::fread(chunk, 1, sizeof(chunk), file)) > 0)
+        {
+            bytes.insert(bytes.end(), chunk, chunk + size);
+        }
+        std::fclose(file);
+    }
+    return bytes;
+}
+
+uint32_t read_u32(const std::vector<unsigned char> &bytes, const size_t offset)
+{
+    uint32_t value = 0;
+    if (offset + sizeof(value) <= bytes.size())
+    {
+        std::memcpy(&value, bytes.data() + offset, sizeof(value));
+    }
+    return value;
+}
+
+// Writes a BMP file of `bit_count` bits per pixel and returns whether it worked. pixel(x, y)
+// is a palette index for 1 and 8 bits and the bytes B, G, R (and A) from the low one up for 24
+// and 32; y counts from the bottom row, the rows of a top-down file are stored the other way.
+bool write_bmp(const std::string &file_name, const unsigned int width, const unsigned int height,
+               const unsigned int bit_count, const bool top_down, const std::vector<uint32_t> &palette,
+               const std::function<uint32_t(unsigned int, unsigned int)> &pixel)
+{
+    const size_t row_size = ((static_cast<size_t>(width) * bit_count + 7) / 8 + 3) & ~size_t(3);
+    const uint32_t offset = 14 + 40 + 4 * static_cast<uint32_t>(palette.size());
+    std::vector<unsigned char> bytes;
+    auto put = [&bytes](const uint32_t value, const unsigned int size)
+    {
+        for (unsigned int it = 0; it < size; ++it)
+        {
+            bytes.push_back(static_cast<unsigned char>(value >> (8 * it)));
+        }
+    };
+    put(0x4d42, 2);
+    put(offset + static_cast<uint32_t>(row_size * height), 4);
+    put(0, 4);
+    put(offset, 4);
+    put(40, 4);
+    put(width, 4);
+    put(top_down ? 0u - height : height, 4);
+    put(1, 2);
+    put(bit_count, 2);
+    put(0, 4);
+    put(static_cast<uint32_t>(row_size * height), 4);
+    put(0, 8);
+    put(static_cast<uint32_t>(palette.size()), 4);
+    put(0, 4);
+    for (const uint32_t colour : palette)
+    {
+        put(colour, 4);
+    }
+    for (unsigned int it = 0; it < height; ++it)
+    {
+        const unsigned int y = top_down ? height - 1 - it : it;
+        std::vector<unsigned char> row(row_size);
+        for (unsigned int x = 0; x < width; ++x)
+        {
+            const uint32_t value = pixel(x, y);
+            if (bit_count == 1)
+            {
+                row[x / 8] |= static_cast<unsigned char>((value & 1) << (7 - x % 8));
+            }
+            else
+            {
+                std::memcpy(row.data() + x * (bit_count / 8), &value, bit_count / 8);
+            }
+        }
+        bytes.insert(bytes.end(), row.begin(), row.end());
+    }
+    return write_file(file_name, bytes);
+}
+
+// A byte of noise, or 0xff for about two pixels in three.
+uint32_t noise_byte(const unsigned int x, const unsigned int y, const unsigned int channel)
+{
+    uint32_t seed = x * 2654435761u ^ y * 40503u ^ channel * 97u;
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % 3 == 0 ? (seed >> 24) & 0xff : 0xff;
+}
+
+// BMP files of every bit depth, bottom-up and top-down and at a few white levels, compress to
+// the white mask the reader should see: the brighter palette entry of a 1-bit file, grey
+// values of an 8-bit file at the level and up, and 24 and 32-bit pixels with B, G and R at the
+// level and up whatever the alpha.
+void test_bmp_inputs()
+{
+    const std::string bmp_name = "codertests.in.bmp";
+    const std::string barch_name = "codertests.barch";
+    std::vector<uint32_t> grey(256);
+    for (uint32_t level = 0; level < 256; ++level)
+    {
+        grey[level] = level * 0x010101;
+    }
+    const struct
+    {
+        const char *name;
+        unsigned int bit_count;
+        std::vector<uint32_t> palette;
+        unsigned int white_level;
+    } cases[] = {
+        { "1-bit", 1, { 0x000000, 0xffffff }, 0xff },
+        { "1-bit with white first", 1, { 0xffffff, 0x202020 }, 0xff },
+        { "8-bit grey", 8, grey, 0xff },
+        { "8-bit grey", 8, grey, 200 },
+        { "24-bit", 24, {}, 0xff },
+        { "24-bit", 24, {}, 128 },
+        { "32-bit", 32, {}, 0xff },
+        { "32-bit", 32, {}, 200 }
+    };
+    for (const auto &known : cases)
+    {
+        const unsigned int level = known.white_level;
+        auto pixel = [&known](const unsigned int x, const unsigned int y) -> uint32_t
+        {
+            switch (known.bit_count)
+            {
+            case 1: return noise_byte(x, y, 0) & 1;
+            case 8: return noise_byte(x, y, 0);
+            default: return noise_byte(x, y, 0) | noise_byte(x, y, 1) << 8 | noise_byte(x, y, 2) << 16
+                            | noise_byte(x, y, 3) << 24;
+            }
+        };
+        auto white = [&known, level](const uint32_t value)
+        {
+            switch (known.bit_count)
+            {
+            case 1: return (known.palette[value] & 0xff) == 0xff;
+            case 8: return value >= level;
+            default: return (value & 0xff) >= level && ((value >> 8) & 0xff) >= level && ((value >> 16) & 0xff) >= level;
+            }
+        };
+        for (const unsigned int width : { 13u, 70u })
+        {
+            for (const bool top_down : { false, true })
+            {
+                const unsigned int height = 9;
+                const std::string what = std::string(known.name) + (top_down ? " top-down " : " ")
+                                       + std::to_string(width) + "x" + std::to_string(height)
+                                       + " at level " + std::to_string(level);
+                std::vector<unsigned char> expected(static_cast<size_t>(width) * height);
+                for (unsigned int y = 0; y < height; ++y)
+                {
+                    for (unsigned int x = 0; x < width; ++x)
+                    {
+                        expected[static_cast<size_t>(y) * width + x] = white(pixel(x, y)) ? 0xff : 0x00;
+                    }
+                }
+                try
+                {
+                    check(write_bmp(bmp_name, width, height, known.bit_count, top_down, known.palette, pixel),
+                          what + ": can't write the bitmap");
+                    CoderOptions options;
+                    options.white_level = level;
+                    compress(bmp_name, barch_name, options);
+                    std::vector<unsigned char> pixels;
+                    decompress_rows(barch_name, 0, height, pixels);
+                    check(pixels == expected, what + ": pixels differ after decoding");
+                }
+                catch (const std::exception &error)
+                {
+                    check(false, what + ": " + error.what());
+                }
+            }
+        }
+    }
+    std::remove(bmp_name.c_str());
+    std::remove(barch_name.c_str());
+}
+
+// decompress() packs 8 pixels a byte into 1-bit BMP and PBM files, most significant bit first.
+// The BMP has a black and a white palette entry and its rows bottom-up and padded to 4 bytes,
+// white is a set bit. PBM has a text header and its rows top-first and padded to a byte only,
+// black is a set bit. The widths leave part of a byte and need each padding.
+void test_1bit_outputs()
+{
+    const std::string barch_name = "codertests.barch";
+    const std::string out_name = "codertests.out";
+    for (const unsigned int width : { 13u, 32u, 70u })
+    {
+        const unsigned int height = 9;
+        const Image image = make_image(width, height, noise);
+        auto white = [&image](const unsigned int x, const unsigned int y)
+        {
+            return image.pixels[static_cast<size_t>(y) * image.width + x] == 0xff;
+        };
+        std::vector<unsigned char> archive;
+        compress_buffer(image.span(), archive);
+        check(write_file(barch_name, archive), "can't write " + barch_name);
+        const size_t packed = (width + 7) / 8;
+        for (const OutputFormat format : { OutputFormat::Bmp1, OutputFormat::Pbm })
+        {
+            const bool pbm = format == OutputFormat::Pbm;
+            const std::string what = std::string(pbm ? "PBM " : "1-bit BMP ") + std::to_string(width) + "x"
+                                   + std::to_string(height);
+            CoderOptions options;
+            options.output_format = format;
+            try
+            {
+                decompress(barch_name, out_name, options);
+            }
+            catch (const std::exception &error)
+            {
+                check(false, what + ": " + error.what());
+                continue;
+            }
+            const std::vector<unsigned char> bytes = read_file(out_name);
+            size_t offset = 0;
+            size_t row_size = packed;
+            if (pbm)
+            {
+                const std::string header = "P4\n" + std::to_string(width) + " " + std::to_string(height) + "\n";
+                check(bytes.size() >= header.size() && std::equal(header.begin(), header.end(), bytes.begin()),
+                      what + ": wrong header");
+                offset = header.size();
+            }
+            else
+            {
+                static const unsigned char palette[] = { 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0x00 };
+                offset = read_u32(bytes, 10);
+                row_size = (packed + 3) & ~size_t(3);
+                check(bytes.size() > 54 + sizeof(palette) && bytes[0] == 'B' && bytes[1] == 'M'
+                      && read_u32(bytes, 18) == width && read_u32(bytes, 22) == height && bytes[28] == 1
+                      && std::equal(palette, palette + sizeof(palette), bytes.begin() + 54)
+                      && offset == 54 + sizeof(palette), what + ": wrong header or palette");
+            }
+            check(bytes.size() == offset + row_size * height, what + ": wrong file size");
+            if (bytes.size() != offset + row_size * height)
+            {
+                continue;
+            }
+            bool same = true;
+            for (unsigned int row = 0; row < height; ++row)
+            {
+                const unsigned int y = pbm ? height - 1 - row : row;
+                const unsigned char *const bits = bytes.data() + offset + row * row_size;
+                for (unsigned int x = 0; x < width; ++x)
+                {
+                    const bool set = (bits[x / 8] >> (7 - x % 8)) & 1;
+                    same = same && set == (pbm ? !white(x, y) : white(x, y));
+                }
+                for (size_t it = packed; it < row_size; ++it)
+                {
+                    same = same && bits[it] == 0;
+                }
+            }
+            check(same, what + ": pixels differ after decoding");
+        }
+    }
+    std::remove(barch_name.c_str());
+    std::remove(out_name.c_str());
+}
+
+// What decompress_preview() makes of rows [first_row, last_row) of decoded pixels: the first
+// row of every scale_y, its blocks of scale_x pixels rounded to their share of white.
+std::vector<unsigned char> fold_preview(const Image &image, const unsigned int first_row, const unsigned int last_row,
+                                        const unsigned int scale_x, const unsigned int scale_y)
+{
+    std::vector<unsigned char> preview;
+    for (unsigned int y = first_row; y < last_row; y += scale_y)
+    {
+        for (unsigned int x = 0; x < image.width; x += scale_x)
+        {
+            const unsigned int pixels = std::min(scale_x, image.width - x);
+            unsigned int white = 0;
+            for (unsigned int it = 0; it < pixels; ++it)
+            {
+                white += image.pixels[static_cast<size_t>(y) * image.width + x + it] == 0xff;
+            }
+            preview.push_back(static_cast<unsigned char>((white * 255 + pixels / 2) / pixels));
+        }
+    }
+    return preview;
+}
+
+// Previews at every scale, of the whole image and of rows that start and end inside blocks and
+// bands, match a fold of the decoded pixels, with bit codes only and with run and delta rows.
+// decompress_rows() returns the decoded rows across a band boundary, and scales other than
+// 1, 2, 4 and 8 are refused.
+void test_previews()
+{
+    const std::string barch_name = "codertests.barch";
+    const struct
+    {
+        const char *name;
+        Pattern pattern;
+    } patterns[] = { { "noise", noise }, { "frame", frame }, { "checker", checker } };
+    for (const bool row_modes : { true, false })
+    {
+        for (const auto &pattern : patterns)
+        {
+            CoderOptions options;
+            options.row_modes = row_modes;
+            const Image image = make_image(70, 200, pattern.pattern);
+            const std::string what = describe(pattern.name, image, options);
+            std::vector<unsigned char> archive;
+            compress_buffer(image.span(), archive, options);
+            const unsigned int regions[][2] = { { 0, image.height }, { 61, 70 }, { 130, 1 }, { 195, 100 } };
+            for (const auto &region : regions)
+            {
+                for (const unsigned int scale : { 1u, 2u, 4u, 8u })
+                {
+                    for (const unsigned int scale_y : { scale, 1u })
+                    {
+                        const std::string preview_what = what + " preview of rows " + std::to_string(region[0]) + "+"
+                                                       + std::to_string(region[1]) + " at " + std::to_string(scale)
+                                                       + "x" + std::to_string(scale_y);
+                        try
+                        {
+                            std::vector<unsigned char> pixels;
+                            const PreviewInfo info = decompress_preview(archive.data(), archive.size(),
+                                                                        { region[0], region[1], scale, scale_y }, pixels);
+                            const unsigned int first_row = region[0] / scale_y * scale_y;
+                            const unsigned int last_row = std::min(image.height,
+                                                                   (region[0] + region[1] + scale_y - 1) / scale_y * scale_y);
+                            check(info.first_row == first_row && info.row_count == last_row - first_row
+                                  && info.width == (image.width + scale - 1) / scale
+                                  && info.height == (last_row - first_row + scale_y - 1) / scale_y,
+                                  preview_what + ": wrong region");
+                            check(pixels == fold_preview(image, first_row, last_row, scale, scale_y),
+                                  preview_what + ": pixels differ from the decoded rows");
+                        }
+                        catch (const std::exception &error)
+                        {
+                            check(false, preview_what + ": " + error.what());
+                        }
+                    }
+                }
+            }
+
+            check(write_file(barch_name, archive), "can't write " + barch_name);
+            try
+            {
+                std::vector<unsigned char> pixels;
+                decompress_rows(barch_name, 60, 10, pixels);
+                check(pixels == std::vector<unsigned char>(image.pixels.begin() + 60 * image.width,
+                                                           image.pixels.begin() + 70 * image.width),
+                      what + ": rows 60-69 differ");
+            }
+            catch (const std::exception &error)
+            {
+                check(false, what + " rows 60-69: " + error.what());
+            }
+        }
+    }
+    const Image image = make_image(20, 20, noise);
+    std::vector<unsigned char> archive;
+    compress_buffer(image.span(), archive);
+    for (const unsigned int scale : { 0u, 3u, 16u })
+    {
+        std::vector<unsigned char> pixels;
+        bool refused = false;
+        try
+        {
+            decompress_preview(archive.data(), archive.size(), { 0, 20, scale, 1 }, pixels);
+        }
+        catch (const std::runtime_error &)
+        {
+            refused = true;
+        }
+        check(refused, "preview at scale " + std::to_string(scale) + " not refused");
+    }
+    std::remove(barch_name.c_str());
+}
+
+bool file_exists(const std::string &file_name)
+{
+    FILE *const file = std::fopen(file_name.c_str(), "rb");
+    if (file)
+    {
+        std::fclose(file);
+    }
+    return file != nullptr;
+}
+
+// File calls report their progress after every window of bands, rising up to all the rows. A
+// call cancelled from its progress callback throws CoderCancelled at the next band and removes
+// the output it had started.
+void test_progress_and_cancel()
+{
+    const std::string bmp_name = "codertests.in.bmp";
+    const std::string barch_name = "codertests.barch";
+    const std::string out_name = "codertests.out.bmp";
+    const unsigned int width = 100;
+    const unsigned int height = 1000; // several windows of bands
+    check(write_bmp(bmp_name, width, height, 24, false, {},
+                    [](const unsigned int x, const unsigned int y) { return noise(x, y) * 0x010101u; }),
+          "can't write " + bmp_name);
+    for (const bool compressing : { true, false })
+    {
+        const std::string what = compressing ? "compress" : "decompress";
+        const std::string &in_name = compressing ? bmp_name : barch_name;
+        const std::string &output_name = compressing ? barch_name : out_name;
+        std::vector<unsigned int> reported;
+        bool totals = true;
+        CoderControl control;
+        control.progress = [&reported, &totals, height](const unsigned int done, const unsigned int total)
+        {
+            reported.push_back(done);
+            totals = totals && total == height;
+        };
+        try
+        {
+            if (compressing)
+            {
+                compress(in_name, output_name, CoderOptions(), nullptr, control);
+            }
+            else
+            {
+                decompress(in_name, output_name, CoderOptions(), nullptr, control);
+            }
+        }
+        catch (const std::exception &error)
+        {
+            check(false, what + ": " + error.what());
+        }
+        check(reported.size() > 1 && totals && std::is_sorted(reported.begin(), reported.end())
+              && reported.front() > 0 && reported.back() == height, what + ": wrong progress");
+
+        std::atomic<bool> cancel(false);
+        control.cancel = &cancel;
+        control.progress = [&cancel](const unsigned int, const unsigned int) { cancel = true; };
+        const std::string cancelled_name = "codertests.cancelled";
+        bool thrown = false;
+        try
+        {
+            if (compressing)
+            {
+                compress(in_name, cancelled_name, CoderOptions(), nullptr, control);
+            }
+            else
+            {
+                decompress(in_name, cancelled_name, CoderOptions(), nullptr, control);
+            }
+        }
+        catch (const CoderCancelled &)
+        {
+            thrown = true;
+        }
+        catch (const std::exception &error)
+        {
+            check(false, what + " cancelled: " + error.what());
+        }
+        check(thrown, what + ": not cancelled");
+        check(!file_exists(cancelled_name), what + ": cancelled output left behind");
+        std::remove(cancelled_name.c_str());
+    }
+    std::remove(bmp_name.c_str());
+    std::remove(barch_name.c_str());
+    std::remove(out_name.c_str());
+}
+
+// The cache hashes its inputs piece by piece as the coder reads them, which must come out as
+// the hash of the whole file.
+void test_content_hasher()
+{
+    std::vector<unsigned char> bytes(1000);
+    for (size_t i = 0; i < bytes.size(); ++i)
+    {
+        bytes[i] = static_cast<unsigned char>(i * 7 + 3);
+    }
+    for (const size_t size : { 0u, 1u, 31u, 32u, 33u, 100u, 1000u })
+    {
+        for (const size_t piece : { 1u, 5u, 32u, 64u, 77u })
+        {
+            ContentHasher hasher;
+            for (size_t offset = 0; offset < size; offset += piece)
+            {
+                hasher.update(bytes.data() + offset, std::min(piece, size - offset));
+            }
+            check(hasher.value() == content_hash(bytes.data(), size) && hasher.size() == size,
+                  std::to_string(size) + " bytes in pieces of " + std::to_string(piece) + ": hash differs");
+        }
+    }
+}
+
+// A file call is skipped once its output is up to date: run again it hits, and it misses after
+// the input or the output changed or with options that write other bytes. The records survive
+// save() into a new cache on the same index file.
+void test_result_cache()
+{
+    const std::string bmp_name = "codertests.in.bmp";
+    const std::string barch_name = "codertests.barch";
+    const std::string out_name = "codertests.out.bmp";
+    const std::string index_name = "codertests.index";
+    std::remove(index_name.c_str());
+    auto write_input = [&bmp_name](const unsigned int height)
+    {
+        check(write_bmp(bmp_name, 50, height, 24, false, {},
+                        [](const unsigned int x, const unsigned int y) { return noise(x, y) * 0x010101u; }),
+              "can't write " + bmp_name);
+    };
+    auto cached = [&](const CoderOptions &options, const bool compressing)
+    {
+        CoderStats stats;
+        try
+        {
+            if (compressing)
+            {
+                compress(bmp_name, barch_name, options, &stats);
+            }
+            else
+            {
+                decompress(barch_name, out_name, options, &stats);
+            }
+        }
+        catch (const std::exception &error)
+        {
+            check(false, std::string("cached call: ") + error.what());
+        }
+        return stats.cached;
+    };
+
+    CoderOptions options;
+    options.cache = std::make_shared<ResultCache>(index_name);
+    write_input(20);
+    check(!cached(options, true), "cache: first compress hit");
+    check(cached(options, true), "cache: second compress missed");
+    check(!cached(options, false), "cache: first decompress hit");
+    check(cached(options, false), "cache: second decompress missed");
+
+    write_input(21);
+    check(!cached(options, true), "cache: hit after the input changed");
+    check(cached(options, true), "cache: missed after coding the changed input");
+
+    check(write_file(barch_name, { 1, 2, 3 }), "can't write " + barch_name);
+    check(!cached(options, true), "cache: hit after the output changed");
+    check(cached(options, true), "cache: missed after coding over the changed output");
+
+    CoderOptions other = options;
+    other.white_level = 200;
+    check(!cached(other, true), "cache: hit with another white level");
+    check(cached(other, true), "cache: missed with the other white level again");
+    check(!cached(other, false), "cache: decompress hit after its input changed");
+    check(options.cache->hits() == 5 && options.cache->misses() == 6, "cache: wrong hit and miss counts");
+
+    try
+    {
+        options.cache->save();
+    }
+    catch (const std::exception &error)
+    {
+        check(false, std::string("cache: ") + error.what());
+    }
+    other.cache = std::make_shared<ResultCache>(index_name);
+    check(cached(other, true), "cache: compress missed after reloading the index");
+    check(cached(other, false), "cache: decompress missed after reloading the index");
+    other.cache.reset();
+    options.cache.reset();
+    std::remove(bmp_name.c_str());
+    std::remove(barch_name.c_str());
+    std::remove(out_name.c_str());
+    std::remove(index_name.c_str());
+}
+
+// An archive reads back the same, mapped and read entry by entry from the file.
+void test_archive()
+{
+    const char *const file_name = "codertests.barchpak";
+    const Image images[] = { make_image(70, 9, checker), make_image(9, 70, noise), make_image(1, 1, black) };
+    {
+        ArchiveWriter writer(file_name);
+        for (size_t image = 0; image < 3; ++image)
+        {
+            writer.add("image" + std::to_string(image), images[image].span());
+        }
+        writer.finish();
+    }
+    for (const bool mapping : { true, false })
+    {
+        const std::string what = mapping ? "mapped archive" : "unmapped archive";
+        try
+        {
+            const ArchiveReader reader(file_name, mapping);
+            check(reader.entries().size() == 3, what + ": wrong entry count");
+            for (size_t image = 0; image < 3 && image < reader.entries().size(); ++image)
+            {
+                const int found = reader.find("image" + std::to_string(image));
+                check(found >= 0, what + ": entry not found");
+                if (found < 0)
+                {
+                    continue;
+                }
+                const ArchiveEntry &entry = reader.entries()[found];
+                std::vector<unsigned char> archive;
+                reader.read(entry, archive);
+                check(!mapping || std::memcmp(reader.data(entry), archive.data(), archive.size()) == 0,
+                      what + ": data() and read() differ");
+                std::vector<unsigned char> pixels;
+                decompress_buffer(archive.data(), archive.size(), pixels);
+                check(pixels == images[image].pixels, what + ": pixels differ after decoding");
+            }
+        }
+        catch (const std::exception &error)
+        {
+            check(false, what + ": " + error.what());
+        }
+    }
+    std::remove(file_name);
+}
+
+} // namespace
+
+// codertests: runs every test, prints the failures and returns 1 if there were any.
+int main()
+{
+    test_known_bytes();
+    test_round_trips();
+    test_tails();
+    test_v1_magic();
+    test_wide_rows();
+    test_warm_contexts();
+    test_bgr24();
+    test_bmp_inputs();
+    test_1bit_outputs();
+    test_previews();
+    test_progress_and_cancel();
+    test_content_hasher();
+    test_result_cache();
+    test_archive();
+    if (failures)
+    {
+        std::printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    std::printf("all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,19 @@
+import QtQuick 2.9
+
+MouseArea {
+    property alias text: label.text
+    width: childrenRect.width
+    height: childrenRect.height
+    acceptedButtons: Qt.LeftButton
+    Rectangle {
+        width: label.contentWidth + 15
+        height: 26
+        color: "#e3bbb8"
+        radius: 5
+        Text {
+            id: label
+            anchors.centerIn: parent
+            font.pixelSize: 16
+        }
+    }
+}
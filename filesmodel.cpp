@@ -1,176 +1,557 @@
-#include "filesmodel.h"
-
-#include "Coder/coder.h"
-
-#include <QDirIterator>
-#include <QFile>
-
-#include <thread>
-#include <iostream>
-
-FilesModel::FilesModel(QObject *)
-{
-
-}
-
-void FilesModel::update()
-{
-    beginResetModel();
-    modelData.clear();
-    QDirIterator it(path, QStringList(), QDir::Files, QDirIterator::NoIteratorFlags);
-    while (it.hasNext())
-    {
-        QFileInfo fileInfo(it.next());
-        FileStatus::Status status = getFileStatusBySuffix(fileInfo.suffix());
-        modelData.push_back({fileInfo.fileName(), fileInfo.filePath().toStdString(), fileInfo.suffix(), fileInfo.size(), status});
-    }
-    endResetModel();
-}
-
-void FilesModel::finishPrecessing(const std::string &fileName)
-{
-    for (int it = 0; it < modelData.size(); ++it)
-    {
-        if (modelData[it].fullName == fileName)
-        {
-            modelData[it].status = getFileStatusBySuffix(modelData[it].suffix);
-            emit dataChanged(index(it), index(it));
-            break;
-        }
-    }
-}
-
-FileStatus::Status FilesModel::getFileStatusBySuffix(const QString &suffix) const
-{
-    FileStatus::Status status = FileStatus::Unknown;
-    if (suffix == "bmp")
-    {
-        status = FileStatus::NotCompressed;
-    }
-    else if (suffix == "barch")
-    {
-        status = FileStatus::Compressed;
-    }
-    else
-    {
-        status = FileStatus::Unsupported;
-    }
-    return status;
-}
-
-QVariant FilesModel::data(const QModelIndex &index, int role) const
-{
-    if (index.row() >= modelData.size()
-            || role >= Params::Last)
-    {
-        return QVariant();
-    }
-
-    const auto& item = modelData.at(index.row());
-    switch (role)
-    {
-        case Params::Name : return item.name;
-        case Params::Size : return item.size;
-        case Params::Status : return item.status;
-    }
-    return QVariant();
-}
-
-void FilesModel::setPath(const QString &value)
-{
-     if (value != path)
-     {
-         path = value;
-         emit pathChanged();
-         update();
-     }
-}
-
-void FilesModel::compressFile(const int idx)
-{
-    if (idx >= modelData.size())
-    {
-        emit errorHappens("Strange: out of index!");
-        return;
-    }
-    if (modelData[idx].status != FileStatus::NotCompressed)
-    {
-        if (modelData[idx].status == FileStatus::Unsupported)
-        {
-            emit errorHappens("File format is not supported!");
-        }
-        else
-        {
-            emit errorHappens("File must be not compressed!");
-        }
-        return;
-    }
-
-    modelData[idx].status = FileStatus::Processing;
-    emit dataChanged(index(idx), index(idx));
-    std::thread excutor([this, idx](){
-        const auto fileName = modelData[idx].fullName;
-        try
-        {
-            compress(fileName, fileName + ".barch");
-        }
-        catch (const std::exception& e)
-        {
-            std::cerr << "Compresing failed: " << e.what() << std::endl;
-            emit errorHappens("Unsupported file format for commpresing, wrong bmp format or wrong file type!");
-        }
-        finishPrecessing(fileName);
-    });
-    excutor.detach();
-}
-
-void FilesModel::decompressFile(const int idx)
-{
-    if (idx >= modelData.size())
-    {
-        emit errorHappens("Strange: out of index!");
-        return;
-    }
-    if (modelData[idx].status != FileStatus::Compressed)
-    {
-        if (modelData[idx].status == FileStatus::Unsupported)
-        {
-            emit errorHappens("File format is not supported!");
-        }
-        else
-        {
-            emit errorHappens("File must be compressed!");
-        }
-        return;
-    }
-    modelData[idx].status = FileStatus::Processing;
-    emit dataChanged(index(idx), index(idx));
-    std::thread excutor([this, idx](){
-        const auto fileName = modelData[idx].fullName;
-        try
-        {
-            decompress(fileName, fileName + ".bmp");
-        }
-        catch (const std::exception& e)
-        {
-            std::cerr << "Compresing failed: " << e.what() << std::endl;
-            emit errorHappens("Unsupported file format for commpresing, wrong bmp format or wrong file type!");
-        }
-        finishPrecessing(fileName);
-    });
-    excutor.detach();
-}
-
-int FilesModel::rowCount(const QModelIndex &parent) const
-{
-    return static_cast<int>(modelData.size());
-}
-
-QHash<int, QByteArray> FilesModel::roleNames() const
-{
-    return {
-        {static_cast<int>(Params::Name), "name"},
-        {static_cast<int>(Params::Size), "size"},
-        {static_cast<int>(Params::Status), "status"}
-    };
-}
+#include "filesmodel.h"
+
+#include "Coder/coder.h"
+#include "Coder/resultcache.h"
+
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QRunnable>
+#include <QStandardPaths>
+#include <QThread>
+#include <QUrl>
+
+#include <functional>
+
+namespace
+{
+
+class CoderJob : public QRunnable
+{
+public:
+    explicit CoderJob(std::function<void()> work)
+        : work(std::move(work))
+    {}
+
+    void run() override
+    {
+        work();
+    }
+
+private:
+    std::function<void()> work;
+};
+
+// Files handed to the GUI thread at a time while scanning.
+const size_t scanBatchSize = 1024;
+
+}
+
+FilesModel::FilesModel(QObject *)
+    : scanGeneration(0)
+    , jobsTotal(0)
+    , jobsDone(0)
+    , jobsFailed(0)
+    , bytesDone(0)
+    , throughput(0)
+{
+    jobs.setMaxThreadCount(QThread::idealThreadCount());
+    const QString cacheDirectory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    QDir().mkpath(cacheDirectory);
+    cache = std::make_shared<ResultCache>(QFile::encodeName(QDir(cacheDirectory).filePath("results.index")).toStdString());
+    scanner.setMaxThreadCount(1);
+    rescanTimer.setSingleShot(true);
+    rescanTimer.setInterval(300);
+    connect(&rescanTimer, &QTimer::timeout, this, &FilesModel::update);
+    connect(&watcher, &QFileSystemWatcher::directoryChanged, &rescanTimer, static_cast<void (QTimer::*)()>(&QTimer::start));
+}
+
+FilesModel::~FilesModel()
+{
+    // queued files are dropped, running ones stop at their next band and must not report
+    // to a dead model
+    jobs.clear();
+    for (auto &job : running)
+    {
+        *job.second.cancel = true;
+    }
+    jobs.waitForDone();
+    try
+    {
+        cache->save();
+    }
+    catch (const std::exception&)
+    {
+        // the records are lost, the files are coded once more the next time
+    }
+    ++scanGeneration;
+    scanner.waitForDone();
+}
+
+void FilesModel::update()
+{
+    const unsigned int scan = ++scanGeneration;
+    const QString directory = path;
+    scanner.start(new CoderJob([this, scan, directory]()
+    {
+        std::vector<ScanEntry> batch;
+        QDirIterator it(directory, QStringList(), QDir::Files, QDirIterator::NoIteratorFlags);
+        while (it.hasNext() && scanGeneration == scan)
+        {
+            it.next();
+            const QFileInfo fileInfo = it.fileInfo();
+            batch.push_back({fileInfo.fileName(), fileInfo.filePath().toStdString(), fileInfo.suffix(), fileInfo.size()});
+            if (batch.size() == scanBatchSize || !it.hasNext())
+            {
+                QMetaObject::invokeMethod(this, [this, scan, batch]()
+                {
+                    mergeScan(scan, batch);
+                }, Qt::QueuedConnection);
+                batch.clear();
+            }
+        }
+        QMetaObject::invokeMethod(this, [this, scan]()
+        {
+            finishScan(scan);
+        }, Qt::QueuedConnection);
+    }));
+}
+
+void FilesModel::mergeScan(const unsigned int scan, const std::vector<ScanEntry> &entries)
+{
+    if (scan != scanGeneration)
+    {
+        return;
+    }
+    std::vector<const ScanEntry*> added;
+    for (const ScanEntry &entry : entries)
+    {
+        const auto known = rowIndex.find(entry.fullName);
+        if (known == rowIndex.end())
+        {
+            added.push_back(&entry);
+            continue;
+        }
+        FileData &item = modelData[known->second];
+        item.scan = scan;
+        if (item.size != entry.size)
+        {
+            item.size = entry.size;
+            emit dataChanged(index(known->second), index(known->second), {Params::Size, Params::Preview});
+        }
+    }
+    if (added.empty())
+    {
+        return;
+    }
+
+    const int first = static_cast<int>(modelData.size());
+    beginInsertRows(QModelIndex(), first, first + static_cast<int>(added.size()) - 1);
+    for (const ScanEntry *entry : added)
+    {
+        const FileStatus::Status status = running.count(entry->fullName) ? FileStatus::Processing
+                                                                          : getFileStatusBySuffix(entry->suffix);
+        rowIndex[entry->fullName] = static_cast<int>(modelData.size());
+        modelData.push_back({entry->name, entry->fullName, entry->suffix, entry->size, status, scan});
+    }
+    endInsertRows();
+}
+
+void FilesModel::finishScan(const unsigned int scan)
+{
+    if (scan != scanGeneration)
+    {
+        return;
+    }
+    // files the scan didn't see are gone, removed from the end so the rows before stay put
+    bool removed = false;
+    for (int last = static_cast<int>(modelData.size()) - 1; last >= 0; )
+    {
+        if (modelData[last].scan == scan)
+        {
+            --last;
+            continue;
+        }
+        int first = last;
+        while (first > 0 && modelData[first - 1].scan != scan)
+        {
+            --first;
+        }
+        beginRemoveRows(QModelIndex(), first, last);
+        for (int it = first; it <= last; ++it)
+        {
+            rowIndex.erase(modelData[it].fullName);
+        }
+        modelData.erase(modelData.begin() + first, modelData.begin() + last + 1);
+        endRemoveRows();
+        removed = true;
+        last = first - 1;
+    }
+    if (removed)
+    {
+        for (int it = 0; it < static_cast<int>(modelData.size()); ++it)
+        {
+            rowIndex[modelData[it].fullName] = it;
+        }
+    }
+}
+
+int FilesModel::rowOf(const std::string &fileName) const
+{
+    const auto row = rowIndex.find(fileName);
+    return row == rowIndex.end() ? -1 : row->second;
+}
+
+void FilesModel::updateProgress(const std::string &fileName, const double progress)
+{
+    auto job = running.find(fileName);
+    if (job == running.end())
+    {
+        return;
+    }
+    job->second.progress = progress;
+    const int row = rowOf(fileName);
+    if (row >= 0)
+    {
+        emit dataChanged(index(row), index(row), {Params::Progress});
+    }
+}
+
+void FilesModel::finishPrecessing(const std::string &fileName, const qint64 bytes, const QString &error,
+                                  const bool cancelled)
+{
+    running.erase(fileName);
+    const int row = rowOf(fileName);
+    if (row >= 0)
+    {
+        modelData[row].status = getFileStatusBySuffix(modelData[row].suffix);
+        emit dataChanged(index(row), index(row));
+    }
+
+    ++jobsDone;
+    if (!cancelled)
+    {
+        bytesDone += bytes;
+    }
+    if (!error.isEmpty())
+    {
+        ++jobsFailed;
+        emit errorHappens(error);
+    }
+    const qint64 elapsed = batchTimer.elapsed();
+    throughput = elapsed > 0 ? bytesDone / (1024.0 * 1024.0) / (elapsed / 1000.0) : 0;
+    emit batchChanged();
+}
+
+template <typename Context>
+void FilesModel::withContext(ContextPool<Context> &contexts, const std::function<void(Context&)> &work)
+{
+    std::unique_ptr<Context> context;
+    {
+        std::lock_guard<std::mutex> lock(contexts.mutex);
+        if (!contexts.idle.empty())
+        {
+            context = std::move(contexts.idle.back());
+            contexts.idle.pop_back();
+        }
+    }
+    if (!context)
+    {
+        CoderOptions options;
+        options.cache = cache;
+        context.reset(new Context(options));
+    }
+    // a failed or cancelled file leaves the context fit for the next one
+    try
+    {
+        work(*context);
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(contexts.mutex);
+        contexts.idle.push_back(std::move(context));
+        throw;
+    }
+    std::lock_guard<std::mutex> lock(contexts.mutex);
+    contexts.idle.push_back(std::move(context));
+}
+
+void FilesModel::enqueue(const int idx, const bool compressing)
+{
+    if (!isBusy())
+    {
+        jobsTotal = 0;
+        jobsDone = 0;
+        jobsFailed = 0;
+        bytesDone = 0;
+        throughput = 0;
+        batchTimer.start();
+    }
+    ++jobsTotal;
+    emit batchChanged();
+
+    modelData[idx].status = FileStatus::Processing;
+    emit dataChanged(index(idx), index(idx));
+
+    // the job gets copies, the listing may be reset while it waits in the queue
+    const std::string fileName = modelData[idx].fullName;
+    const qint64 bytes = modelData[idx].size;
+    const std::shared_ptr<std::atomic<bool>> cancel = std::make_shared<std::atomic<bool>>(false);
+    running[fileName] = Job{cancel, 0.0};
+    jobs.start(new CoderJob([this, fileName, bytes, compressing, cancel]()
+    {
+        QString error;
+        bool cancelled = false;
+        CoderControl control;
+        control.cancel = cancel.get();
+        int percent = 0;
+        control.progress = [this, fileName, &percent](const unsigned int done, const unsigned int total)
+        {
+            // one update per percent is plenty for the view
+            const int now = total > 0 ? static_cast<int>(100.0 * done / total) : 100;
+            if (now != percent)
+            {
+                percent = now;
+                QMetaObject::invokeMethod(this, [this, fileName, now]()
+                {
+                    updateProgress(fileName, now / 100.0);
+                }, Qt::QueuedConnection);
+            }
+        };
+        try
+        {
+            if (*cancel)
+            {
+                throw CoderCancelled();
+            }
+            if (compressing)
+            {
+                withContext<Encoder>(encoders, [&fileName, &control](Encoder &encoder)
+                {
+                    encoder.compress(fileName, fileName + ".barch", control);
+                });
+            }
+            else
+            {
+                withContext<Decoder>(decoders, [&fileName, &control](Decoder &decoder)
+                {
+                    decoder.decompress(fileName, fileName + ".bmp", control);
+                });
+            }
+        }
+        catch (const CoderCancelled&)
+        {
+            cancelled = true;
+        }
+        catch (const std::exception&)
+        {
+            error = compressing ? "Unsupported file format for commpresing, wrong bmp format or wrong file type!"
+                                : "Unsupported file format for decommpresing, wrong barch format or wrong file type!";
+        }
+        QMetaObject::invokeMethod(this, [this, fileName, bytes, error, cancelled]()
+        {
+            finishPrecessing(fileName, bytes, error, cancelled);
+        }, Qt::QueuedConnection);
+    }));
+}
+
+int FilesModel::getCacheHits() const
+{
+    return static_cast<int>(cache->hits());
+}
+
+int FilesModel::getCacheMisses() const
+{
+    return static_cast<int>(cache->misses());
+}
+
+FileStatus::Status FilesModel::getFileStatusBySuffix(const QString &suffix) const
+{
+    FileStatus::Status status = FileStatus::Unknown;
+    if (suffix == "bmp")
+    {
+        status = FileStatus::NotCompressed;
+    }
+    else if (suffix == "barch")
+    {
+        status = FileStatus::Compressed;
+    }
+    else
+    {
+        status = FileStatus::Unsupported;
+    }
+    return status;
+}
+
+QVariant FilesModel::data(const QModelIndex &index, int role) const
+{
+    if (index.row() >= modelData.size()
+            || role >= Params::Last)
+    {
+        return QVariant();
+    }
+
+    const auto& item = modelData.at(index.row());
+    switch (role)
+    {
+        case Params::Name : return item.name;
+        case Params::Size : return item.size;
+        case Params::Status : return item.status;
+        case Params::Progress :
+        case Params::Cancelling : {
+            const auto job = running.find(item.fullName);
+            if (job == running.end())
+            {
+                return role == Params::Progress ? QVariant(0.0) : QVariant(false);
+            }
+            return role == Params::Progress ? QVariant(job->second.progress) : QVariant(job->second.cancel->load());
+        }
+        case Params::Preview : {
+            if (item.status != FileStatus::Compressed)
+            {
+                return QString();
+            }
+            // the size is part of the source, so a rewritten file is previewed anew
+            return QStringLiteral("image://barch/%1/%2").arg(item.size)
+                    .arg(QString::fromLatin1(QUrl::toPercentEncoding(QString::fromStdString(item.fullName))));
+        }
+    }
+    return QVariant();
+}
+
+void FilesModel::setPath(const QString &value)
+{
+     if (value != path)
+     {
+         if (!watcher.directories().isEmpty())
+         {
+             watcher.removePaths(watcher.directories());
+         }
+         path = value;
+         // a different directory starts from an empty listing, rows come in with the scan
+         ++scanGeneration;
+         beginResetModel();
+         modelData.clear();
+         rowIndex.clear();
+         endResetModel();
+         watcher.addPath(path);
+         emit pathChanged();
+         update();
+     }
+}
+
+void FilesModel::compressFile(const int idx)
+{
+    if (idx >= modelData.size())
+    {
+        emit errorHappens("Strange: out of index!");
+        return;
+    }
+    if (modelData[idx].status != FileStatus::NotCompressed)
+    {
+        if (modelData[idx].status == FileStatus::Unsupported)
+        {
+            emit errorHappens("File format is not supported!");
+        }
+        else
+        {
+            emit errorHappens("File must be not compressed!");
+        }
+        return;
+    }
+
+    enqueue(idx, true);
+}
+
+void FilesModel::decompressFile(const int idx)
+{
+    if (idx >= modelData.size())
+    {
+        emit errorHappens("Strange: out of index!");
+        return;
+    }
+    if (modelData[idx].status != FileStatus::Compressed)
+    {
+        if (modelData[idx].status == FileStatus::Unsupported)
+        {
+            emit errorHappens("File format is not supported!");
+        }
+        else
+        {
+            emit errorHappens("File must be compressed!");
+        }
+        return;
+    }
+    enqueue(idx, false);
+}
+
+void FilesModel::compressAll()
+{
+    int queued = 0;
+    for (int it = 0; it < modelData.size(); ++it)
+    {
+        if (modelData[it].status == FileStatus::NotCompressed)
+        {
+            enqueue(it, true);
+            ++queued;
+        }
+    }
+    if (queued == 0)
+    {
+        emit errorHappens("Nothing to compress!");
+    }
+}
+
+void FilesModel::decompressAll()
+{
+    int queued = 0;
+    for (int it = 0; it < modelData.size(); ++it)
+    {
+        if (modelData[it].status == FileStatus::Compressed)
+        {
+            enqueue(it, false);
+            ++queued;
+        }
+    }
+    if (queued == 0)
+    {
+        emit errorHappens("Nothing to decompress!");
+    }
+}
+
+void FilesModel::cancelFile(const int idx)
+{
+    if (idx < 0 || idx >= modelData.size())
+    {
+        emit errorHappens("Strange: out of index!");
+        return;
+    }
+    auto job = running.find(modelData[idx].fullName);
+    if (job == running.end())
+    {
+        emit errorHappens("File is not being processed!");
+        return;
+    }
+    *job->second.cancel = true;
+    emit dataChanged(index(idx), index(idx), {Params::Cancelling});
+}
+
+void FilesModel::cancelAll()
+{
+    for (auto &job : running)
+    {
+        *job.second.cancel = true;
+    }
+    if (!modelData.empty())
+    {
+        emit dataChanged(index(0), index(static_cast<int>(modelData.size()) - 1), {Params::Cancelling});
+    }
+}
+
+int FilesModel::rowCount(const QModelIndex &parent) const
+{
+    return static_cast<int>(modelData.size());
+}
+
+QHash<int, QByteArray> FilesModel::roleNames() const
+{
+    return {
+        {static_cast<int>(Params::Name), "name"},
+        {static_cast<int>(Params::Size), "size"},
+        {static_cast<int>(Params::Status), "status"},
+        {static_cast<int>(Params::Progress), "progress"},
+        {static_cast<int>(Params::Cancelling), "cancelling"},
+        {static_cast<int>(Params::Preview), "preview"}
+    };
+}
@@ -1,80 +1,194 @@
-#ifndef FILESMODEL_H
-#define FILESMODEL_H
-
-#include <QAbstractListModel>
-#include <QQmlEngine>
-#include <vector>
-
-namespace FileStatus
-{
-    Q_NAMESPACE
-    enum Status
-    {
-        Unknown,
-        Unsupported,
-        Compressed,
-        NotCompressed,
-        Processing
-    };
-    Q_ENUM_NS(Status)
-}
-
-class FilesModel : public QAbstractListModel
-{
-    Q_OBJECT
-    struct FileData
-    {
-        QString name;
-        std::string fullName;
-        QString suffix;
-        qint64 size;
-        FileStatus::Status status;
-    };
-
-
-
-    enum Params
-    {
-        Name = 0,
-        Size = 1,
-        Status = 2,
-
-        Last = 3
-    };
-
-    Q_PROPERTY(QString path READ getPath WRITE setPath NOTIFY pathChanged)
-
-public:
-    explicit FilesModel(QObject *parent = nullptr);
-
-    virtual ~FilesModel() override = default;
-
-    QVariant data(const QModelIndex &index, int role) const override;
-
-    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
-
-    QHash<int,QByteArray> roleNames() const override;
-
-    void setPath(const QString& value);
-
-    const QString& getPath() const { return path; }
-
-    Q_INVOKABLE void compressFile(const int idx);
-
-    Q_INVOKABLE void decompressFile(const int idx);
-
-    Q_INVOKABLE void update();
-
-signals:
-    void pathChanged();
-    void errorHappens(const QString message) const;
-
-private:
-    void finishPrecessing(const std::string &fileName);
-    FileStatus::Status getFileStatusBySuffix(const QString& suffix) const;
-
-    std::vector<FileData> modelData;
-    QString path;
-};
-
-#endif // FILESMODEL_H
+#ifndef FILESMODEL_H
+#define FILESMODEL_H
+
+#include <QAbstractListModel>
+#include <QElapsedTimer>
+#include <QFileSystemWatcher>
+#include <QQmlEngine>
+#include <QThreadPool>
+#include <QTimer>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Decoder;
+class Encoder;
+class ResultCache;
+
+namespace FileStatus
+{
+    Q_NAMESPACE
+    enum Status
+    {
+        Unknown,
+        Unsupported,
+        Compressed,
+        NotCompressed,
+        Processing
+    };
+    Q_ENUM_NS(Status)
+}
+
+class FilesModel : public QAbstractListModel
+{
+    Q_OBJECT
+    struct FileData
+    {
+        QString name;
+        std::string fullName;
+        QString suffix;
+        qint64 size;
+        FileStatus::Status status;
+        unsigned int scan; // the last scan that saw the file
+    };
+
+    // A file found by the directory scan, handed to the GUI thread in batches.
+    struct ScanEntry
+    {
+        QString name;
+        std::string fullName;
+        QString suffix;
+        qint64 size;
+    };
+
+
+
+    // A queued or running job, kept by file name so it survives a refresh of the listing.
+    struct Job
+    {
+        std::shared_ptr<std::atomic<bool>> cancel;
+        double progress;
+    };
+
+    // Idle coder contexts. A job takes one for its run and puts it back, so their buffers are
+    // reused from file to file and there are never more than the pool has threads.
+    template <typename Context>
+    struct ContextPool
+    {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Context>> idle;
+    };
+
+    enum Params
+    {
+        Name = 0,
+        Size = 1,
+        Status = 2,
+        Progress = 3,   // 0 to 1 while the file is processed
+        Cancelling = 4, // cancel was asked for, the job has yet to stop
+        Preview = 5,    // image source of a preview of a compressed file, empty for others
+
+        Last = 6
+    };
+
+    Q_PROPERTY(QString path READ getPath WRITE setPath NOTIFY pathChanged)
+
+    // aggregate state of the queued jobs, reset when a new batch starts on an idle queue
+    Q_PROPERTY(bool busy READ isBusy NOTIFY batchChanged)
+    Q_PROPERTY(int jobsTotal READ getJobsTotal NOTIFY batchChanged)
+    Q_PROPERTY(int jobsDone READ getJobsDone NOTIFY batchChanged)
+    Q_PROPERTY(int jobsFailed READ getJobsFailed NOTIFY batchChanged)
+    Q_PROPERTY(double throughput READ getThroughput NOTIFY batchChanged)
+    // files whose output was already up to date and was not coded again, since the start
+    Q_PROPERTY(int cacheHits READ getCacheHits NOTIFY batchChanged)
+    Q_PROPERTY(int cacheMisses READ getCacheMisses NOTIFY batchChanged)
+
+public:
+    explicit FilesModel(QObject *parent = nullptr);
+
+    virtual ~FilesModel() override;
+
+    QVariant data(const QModelIndex &index, int role) const override;
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+
+    QHash<int,QByteArray> roleNames() const override;
+
+    void setPath(const QString& value);
+
+    const QString& getPath() const { return path; }
+
+    Q_INVOKABLE void compressFile(const int idx);
+
+    Q_INVOKABLE void decompressFile(const int idx);
+
+    // Queue every file of the listing that can be compressed / decompressed.
+    Q_INVOKABLE void compressAll();
+
+    Q_INVOKABLE void decompressAll();
+
+    // Stops the job of a file: a queued one never starts, a running one stops at its next
+    // band and removes its partial output.
+    Q_INVOKABLE void cancelFile(const int idx);
+
+    Q_INVOKABLE void cancelAll();
+
+    // Rescans the directory on a background thread. Files are added, updated and removed
+    // row by row as the scan goes, the listing is never reset.
+    Q_INVOKABLE void update();
+
+    bool isBusy() const { return jobsDone < jobsTotal; }
+
+    int getJobsTotal() const { return jobsTotal; }
+
+    int getJobsDone() const { return jobsDone; }
+
+    int getJobsFailed() const { return jobsFailed; }
+
+    // megabytes of input per second since the batch started
+    double getThroughput() const { return throughput; }
+
+    int getCacheHits() const;
+
+    int getCacheMisses() const;
+
+signals:
+    void pathChanged();
+    void batchChanged();
+    void errorHappens(const QString message) const;
+
+private:
+    void enqueue(const int idx, const bool compressing);
+    template <typename Context>
+    void withContext(ContextPool<Context> &contexts, const std::function<void(Context&)> &work);
+    void finishPrecessing(const std::string &fileName, const qint64 bytes, const QString &error, const bool cancelled);
+    void updateProgress(const std::string &fileName, const double progress);
+    int rowOf(const std::string &fileName) const;
+    void mergeScan(const unsigned int scan, const std::vector<ScanEntry> &entries);
+    void finishScan(const unsigned int scan);
+    FileStatus::Status getFileStatusBySuffix(const QString& suffix) const;
+
+    std::vector<FileData> modelData;
+    QString path;
+    std::unordered_map<std::string, Job> running;
+    // row of every file by its full name
+    std::unordered_map<std::string, int> rowIndex;
+
+    // one scan at a time; a newer scan makes the older one stop and its batches be dropped
+    QThreadPool scanner;
+    std::atomic<unsigned int> scanGeneration;
+    QFileSystemWatcher watcher;
+    // coalesces the bursts of change notifications into one rescan
+    QTimer rescanTimer;
+
+    // outputs known to be up to date, kept in the application's cache directory
+    std::shared_ptr<ResultCache> cache;
+    // made with the model's options on first use, destroyed with the model
+    ContextPool<Encoder> encoders;
+    ContextPool<Decoder> decoders;
+
+    // bounded to the core count, files wait in its queue
+    QThreadPool jobs;
+    QElapsedTimer batchTimer;
+    int jobsTotal;
+    int jobsDone;
+    int jobsFailed;
+    qint64 bytesDone;
+    double throughput;
+};
+
+#endif // FILESMODEL_H
@@ -0,0 +1,74 @@
+#include "previewprovider.h"
+
+#include "Coder/coder.h"
+
+#include <QUrl>
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <vector>
+
+namespace
+{
+
+// Side of a preview when the image doesn't ask for a size.
+const int defaultPreviewSide = 128;
+
+// The largest scale of 1, 2, 4 or 8 that keeps `side` pixels at least `wanted` pixels.
+unsigned int previewScale(const unsigned int side, const int wanted)
+{
+    unsigned int scale = 1;
+    while (scale < 8 && wanted > 0 && side / (scale * 2) >= static_cast<unsigned int>(wanted))
+    {
+        scale *= 2;
+    }
+    return scale;
+}
+
+}
+
+PreviewProvider::PreviewProvider()
+    : QQuickImageProvider(QQuickImageProvider::Image, QQmlImageProviderBase::ForceAsynchronousImageLoading)
+{}
+
+QImage PreviewProvider::requestImage(const QString &id, QSize *size, const QSize &requestedSize)
+{
+    const int separator = id.indexOf('/');
+    const std::string fileName = QUrl::fromPercentEncoding(id.mid(separator + 1).toUtf8()).toStdString();
+    const int wantedWidth = requestedSize.width() > 0 ? requestedSize.width() : defaultPreviewSide;
+    const int wantedHeight = requestedSize.height() > 0 ? requestedSize.height() : defaultPreviewSide;
+
+    QImage image;
+    try
+    {
+        const BarchInfo info = read_barch_info(fileName);
+        PreviewRegion region = { 0, info.height, previewScale(info.width, wantedWidth),
+                                 previewScale(info.height, wantedHeight) };
+        // the aspect is kept, both sides shrink by the scale the tighter one allows
+        region.scale_x = region.scale_y = std::min(region.scale_x, region.scale_y);
+        std::vector<unsigned char> pixels;
+        const PreviewInfo preview = decompress_preview(fileName, region, pixels);
+        image = QImage(static_cast<int>(preview.width), static_cast<int>(preview.height), QImage::Format_Grayscale8);
+        // the rows come bottom-up, as in the bitmap
+        for (unsigned int row = 0; row < preview.height; ++row)
+        {
+            std::memcpy(image.scanLine(static_cast<int>(preview.height - 1 - row)),
+                        pixels.data() + static_cast<size_t>(row) * preview.width, preview.width);
+        }
+        if (image.width() > wantedWidth || image.height() > wantedHeight)
+        {
+            image = image.scaled(wantedWidth, wantedHeight, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+        }
+    }
+    catch (const std::exception&)
+    {
+        // an unreadable file shows no preview, the listing tells about it when it is decoded
+        image = QImage();
+    }
+    if (size)
+    {
+        *size = image.size();
+    }
+    return image;
+}
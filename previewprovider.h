@@ -0,0 +1,17 @@
+#ifndef PREVIEWPROVIDER_H
+#define PREVIEWPROVIDER_H
+
+#include <QQuickImageProvider>
+
+// Serves "image://barch/<size>/<file>" previews of .barch files, decoded on the loader's
+// thread at the coarsest scale that still fills the requested size. The file name is
+// percent-encoded, the size only tells a changed file apart so it isn't served from a cache.
+class PreviewProvider : public QQuickImageProvider
+{
+public:
+    PreviewProvider();
+
+    QImage requestImage(const QString &id, QSize *size, const QSize &requestedSize) override;
+};
+
+#endif // PREVIEWPROVIDER_H